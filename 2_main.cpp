@@ -3,20 +3,22 @@
 
 #include <fstream>
 #include <iostream>
+#include <string>
+#include <cstdlib>
 #include "MyFileSystem.h"
 
-void CreateFS()
+void CreateFS(const std::string& path, unsigned int size = VOLUME_SIZE * BYTES_PER_SECTOR)
 {
-    std::ofstream file(FS_PATH, std::ios::binary | std::ios::out | std::ios::trunc);
-    file.seekp(VOLUME_SIZE * BYTES_PER_SECTOR - 1);
+    std::ofstream file(path, std::ios::binary | std::ios::out | std::ios::trunc);
+    file.seekp(size - 1);
     const char data = 0;
     file.write(&data, 1);
     file.close();
 }
 
-void WriteBootSector()
+void WriteBootSector(const std::string& path, unsigned int stripes = 1, unsigned int stripeUnit = 0)
 {
-    std::fstream file(FS_PATH, std::ios::binary | std::ios::in | std::ios::out);
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
 
     unsigned int data = BYTES_PER_SECTOR;
     file.write((char*)&data, 2);
@@ -33,12 +35,34 @@ void WriteBootSector()
     data = VOLUME_SIZE;
     file.write((char*)&data, 4);  
 
+    //data region striped across backing files
+    if (stripes > 1)
+    {
+        file.seekp(STRIPE_COUNT_OFFSET);
+        file.write((char*)&stripes, 1);
+        file.seekp(STRIPE_UNIT_OFFSET);
+        file.write((char*)&stripeUnit, 4);
+    }
+
+    //free space summary, every cluster after RDET is free
+    file.seekp(FSINFO_OFFSET);
+    data = FSINFO_SIGNATURE;
+    file.write((char*)&data, 4);
+    data = FINAL_CLUSTER - STARTING_CLUSTER;
+    file.write((char*)&data, 4);
+    data = STARTING_CLUSTER + 1;
+    file.write((char*)&data, 4);
+    data = 0;
+    file.write((char*)&data, 4);
+    data = 1;
+    file.write((char*)&data, 1);
+
     file.close();
 }
 
-void Write3FATEntries()
+void Write3FATEntries(const std::string& path)
 {
-    std::fstream file(FS_PATH, std::ios::binary | std::ios::in | std::ios::out);
+    std::fstream file(path, std::ios::binary | std::ios::in | std::ios::out);
     //write the first 3 entries in FAT
     file.seekp(SECTORS_BEFORE_FAT * BYTES_PER_SECTOR);
     unsigned int my_eof = MY_EOF;
@@ -48,6 +72,28 @@ void Write3FATEntries()
     file.close();
 }
 
+void CreateVolume(const std::string& path)
+{
+    CreateFS(path);
+    WriteBootSector(path);
+    Write3FATEntries(path);
+}
+
+void CreateStripedVolume(const std::string& path, unsigned int stripes, unsigned int stripeUnit)
+{
+    //each backing file holds every stripes-th unit of the data region, the volume file also holds boot sector and FAT
+    const unsigned int dataStart = (SECTORS_BEFORE_FAT + FAT_SIZE) * BYTES_PER_SECTOR;
+    const unsigned int unitSize = stripeUnit * SECTORS_PER_CLUSTER * BYTES_PER_SECTOR;
+    unsigned int units = (VOLUME_SIZE * BYTES_PER_SECTOR - dataStart + unitSize - 1) / unitSize;
+    unsigned int stripeSize = (units + stripes - 1) / stripes * unitSize;
+
+    CreateFS(path, dataStart + stripeSize);
+    for (unsigned int i = 1; i < stripes; i++)
+        CreateFS(MyFileSystem::StripePath(path, i), stripeSize);
+    WriteBootSector(path, stripes, stripeUnit);
+    Write3FATEntries(path);
+}
+
 bool CheckFSExists()
 {
     std::ifstream f;
@@ -57,19 +103,82 @@ bool CheckFSExists()
     return result;
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    //crashtest [scenarios] [seed] [operations] - crash random operations on a scratch volume and check recovery
+    if (argc > 1 && std::string(argv[1]) == "crashtest")
+    {
+        unsigned int scenarios = argc > 2 ? std::atoi(argv[2]) : 100;
+        unsigned int seed = argc > 3 ? std::atoi(argv[3]) : 1;
+        unsigned int operations = argc > 4 ? std::atoi(argv[4]) : 40;
+        MyFileSystem::CrashTest("crashtest.dat", scenarios, seed, operations, CreateVolume, CreateStripedVolume);
+        return 0;
+    }
+    //replay <trace> [max] [volume] - run a recorded trace on a new volume or a copy of the given one
+    if (argc > 2 && std::string(argv[1]) == "replay")
+    {
+        bool maxSpeed = false;
+        std::string volume;
+        for (int i = 3; i < argc; i++)
+        {
+            if (std::string(argv[i]) == "max")
+                maxSpeed = true;
+            else volume = argv[i];
+        }
+        MyFileSystem::ReplayTrace(argv[2], "replay.dat", volume, maxSpeed, CreateVolume);
+        return 0;
+    }
+
+    //stripe <files> [unit] - create the volume striped across files, unit in clusters
+    if (argc > 2 && std::string(argv[1]) == "stripe" && CheckFSExists())
+        std::cout << "File System file already exists, opening it" << '\n';
+    else if (argc > 2 && std::string(argv[1]) == "stripe")
+    {
+        unsigned int stripes = std::atoi(argv[2]);
+        unsigned int stripeUnit = argc > 3 ? std::atoi(argv[3]) : STRIPE_UNIT;
+        if (stripes < 2 || stripes > 255 || stripeUnit == 0)
+        {
+            std::cout << "Stripe over 2 to 255 files with a unit of at least 1 cluster\n";
+            return 1;
+        }
+        std::cout << "Creating File System file striped across " << stripes << " files" << '\n';
+        CreateStripedVolume(FS_PATH, stripes, stripeUnit);
+    }
+
     if (!CheckFSExists())
     {
         std::cout << "Creating File System file" << '\n';
-        CreateFS();
-        WriteBootSector();
-        Write3FATEntries();
+        CreateVolume(FS_PATH);
     }
 
+    //an archive on stdin is not mixed with the password, which is read from the terminal instead
+    bool archiveOnStdin = argc > 2 && std::string(argv[1]) == "ingest" && std::string(argv[2]) == "-";
+    std::ifstream console;
+    if (archiveOnStdin)
+        console.open(CONSOLE_PATH);
+
     MyFileSystem myFS;
-    if (!myFS.CheckFSPassword())
+    if (!myFS.IsMounted() || !myFS.CheckFSPassword(archiveOnStdin ? console : std::cin))
         return 1;
+
+    //ingest <archive|-> - import every file of a tar archive, "-" reads it from stdin
+    if (argc > 2 && std::string(argv[1]) == "ingest")
+    {
+        myFS.IngestTar(argv[2]);
+        return 0;
+    }
+    //backup <generation> <archive> - write files changed after generation, 0 - every file, to a backup archive
+    if (argc > 3 && std::string(argv[1]) == "backup")
+    {
+        myFS.BackUpFiles(std::atoi(argv[2]), argv[3]);
+        return 0;
+    }
+    //restore <archive>... - make files match a full backup and the incremental ones after it, in order
+    if (argc > 2 && std::string(argv[1]) == "restore")
+    {
+        myFS.RestoreBackups(std::vector<std::string>(argv + 2, argv + argc));
+        return 0;
+    }
         
     myFS.HandleInput();
     return 0;
@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <cstdio>
+#include "MyFileSystem.h"
+
+void MyFileSystem::BackUpFiles(unsigned int sinceGeneration, const std::string& archivePath)
+{
+    if (sinceGeneration > fsInfo.generation)
+    {
+        std::cout << "Volume is only at generation " << fsInfo.generation << "!\n";
+        return;
+    }
+    std::ofstream out(archivePath, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!out)
+    {
+        std::cout << "Cannot create backup file!\n";
+        return;
+    }
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+    //every name goes in so files deleted since then can be found, whatever reused their slots
+    const size_t nameSize = ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH;
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+    BackupHeader header;
+    header.baseGeneration = sinceGeneration;
+    header.generation = fsInfo.generation;
+    std::string names;
+    std::vector<std::pair<Entry, unsigned int>> changed;
+    bool end = false;
+    for (size_t c = 0; c < rdet.size() && !end; c++)
+    {
+        for (size_t slot = 0; slot < rdet[c].size(); slot += sizeof(Entry))
+        {
+            Entry *e = (Entry*)&rdet[c][slot];
+            if (e->name[0] == 0)
+            {
+                end = true;
+                break;
+            }
+            if (e->name[0] == -27 || e->name[0] == ENTRY_CONTINUATION)
+                continue;
+            names.append(e->name, nameSize);
+            header.files++;
+            if (sinceGeneration == 0 || e->generation > sinceGeneration)
+                changed.push_back(std::make_pair(*e, GetClusterOffset(rdetClusters[c]) + (unsigned int)slot));
+        }
+    }
+    header.records = changed.size();
+    out.write((char*)&header, sizeof(BackupHeader));
+    out.write(names.c_str(), names.size());
+
+    //stored content is copied as it is, protected files stay encrypted and need no password
+    const size_t clusterSize = bytesPerSector * sectorsPerCluster;
+    const size_t chunkClusters = INGEST_CHUNK / clusterSize;
+    unsigned long long bytes = 0;
+    for (std::pair<Entry, unsigned int>& file : changed)
+    {
+        Entry *pE = &file.first;
+        out.write((char*)pE, sizeof(Entry));
+        if (pE->flags & ENTRY_INLINE)
+        {
+            std::string data = ReadInlineData(pE, file.second);
+            out.write(data.c_str(), data.size());
+        }
+        else
+        {
+            std::vector<unsigned int> clusters = GetFileClusters(pE, file.second);
+            for (size_t first = 0; first * clusterSize < pE->fileSize; first += chunkClusters)
+            {
+                std::vector<unsigned int> part(clusters.begin() + first, clusters.begin() + std::min(first + chunkClusters, clusters.size()));
+                bool verified = true;
+                std::string chunk = ReadFileContent(std::min(chunkClusters * clusterSize, pE->fileSize - first * clusterSize), part, &verified);
+                //a file left out would look unchanged to a restore, so the whole backup fails
+                if (!verified)
+                {
+                    std::cout << "File " << pE->GetFullName() << " is damaged, backup is not written!\n";
+                    out.close();
+                    std::remove(archivePath.c_str());
+                    return;
+                }
+                out.write(chunk.c_str(), chunk.size());
+            }
+        }
+        if (pE->flags & ENTRY_WRAPPED_KEY)
+            out.write(ReadKeySlot(pE, file.second).c_str(), KEY_SLOT_SIZE);
+        bytes += pE->fileSize;
+    }
+    out.close();
+    if (!out)
+    {
+        std::cout << "Cannot write backup file!\n";
+        std::remove(archivePath.c_str());
+        return;
+    }
+
+    //generation of a backup is never given to a later change, even if the volume is not closed properly
+    WriteAt(FSINFO_OFFSET, (char*)&fsInfo, sizeof(FSInfo));
+    Flush();
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Backed up " << header.records << " of " << header.files << " files, " << std::fixed << std::setprecision(2)
+        << bytes / 1048576.0 << " MB in " << elapsed << " s\n";
+    std::cout.unsetf(std::ios::fixed);
+    std::cout << "Next incremental backup is from generation " << header.generation << '\n';
+}
+
+bool MyFileSystem::ApplyBackup(std::ifstream& in, const BackupHeader& header)
+{
+    const size_t nameSize = ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH;
+    std::string names(header.files * nameSize, 0);
+    in.read(&names[0], names.size());
+    if (!in)
+    {
+        std::cout << "Backup is damaged or truncated!\n";
+        return false;
+    }
+    std::set<std::string> kept;
+    for (size_t i = 0; i < names.size(); i += nameSize)
+        kept.insert(names.substr(i, nameSize));
+
+    //names of changed files, found by skipping over their content
+    std::streampos records = in.tellg();
+    in.seekg(0, std::ios::end);
+    std::streampos archiveEnd = in.tellg();
+    in.seekg(records);
+    std::set<std::string> replaced;
+    for (unsigned int i = 0; i < header.records && in; i++)
+    {
+        Entry e;
+        in.read((char*)&e, sizeof(Entry));
+        replaced.insert(std::string(e.name, e.name + nameSize));
+        in.seekg(e.fileSize + (e.flags & ENTRY_WRAPPED_KEY ? KEY_SLOT_SIZE : 0), std::ios::cur);
+    }
+    if (!in || in.tellg() > archiveEnd)
+    {
+        std::cout << "Backup is damaged or truncated!\n";
+        return false;
+    }
+    in.seekg(records);
+
+    //files deleted since the base generation and old versions of changed ones go first, their clusters are reused
+    //passwords are not asked for, the backup holds every file of the volume
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+    std::vector<bool> changed(rdet.size(), false);
+    unsigned int deleted = 0;
+    bool end = false;
+    for (size_t c = 0; c < rdet.size() && !end; c++)
+    {
+        for (size_t slot = 0; slot < rdet[c].size(); slot += sizeof(Entry))
+        {
+            Entry *e = (Entry*)&rdet[c][slot];
+            if (e->name[0] == 0)
+            {
+                end = true;
+                break;
+            }
+            if (e->name[0] == -27 || e->name[0] == ENTRY_CONTINUATION)
+                continue;
+            std::string name(e->name, e->name + nameSize);
+            if (kept.count(name) && !replaced.count(name))
+                continue;
+
+            QueueReclaim(e, GetClusterOffset(rdetClusters[c]) + slot);
+            for (unsigned int i = 1; i <= e->extraSlots; i++)
+            {
+                std::fill(&rdet[c][slot + i * sizeof(Entry)], &rdet[c][slot + (i + 1) * sizeof(Entry)], 0);
+                rdet[c][slot + i * sizeof(Entry)] = (char)0xE5;
+            }
+            e->reserved[0] = 0;
+            e->name[0] = (char)0xE5;
+            e->generation = ++fsInfo.generation;
+            fsInfo.firstFreeSlot = std::min(fsInfo.firstFreeSlot, (unsigned int)(c * rdet[c].size() + slot));
+            changed[c] = true;
+            deleted++;
+        }
+    }
+    for (size_t c = 0; c < rdet.size(); c++)
+    {
+        if (changed[c])
+            WriteAt(GetClusterOffset(rdetClusters[c]), &rdet[c][0], rdet[c].size());
+    }
+    Flush();
+    indexValid = false;
+    ReclaimClusters();
+
+    //entries are written in batches once the content of their files is on the volume
+    std::vector<Entry> entries;
+    std::vector<std::string> fileNames;
+    std::vector<std::string> slotData;
+    std::vector<std::vector<unsigned int>> owned;
+    unsigned int restored = 0, skipped = 0;
+    auto writeBatch = [&]()
+    {
+        unsigned int written = WriteFileEntries(entries, fileNames, slotData);
+        for (size_t i = written; i < entries.size(); i++)
+        {
+            FreeClusters(owned[i]);
+            skipped++;
+        }
+        if (written < entries.size())
+            std::cout << "Out of space for file entry!\n";
+        restored += written;
+        entries.clear();
+        fileNames.clear();
+        slotData.clear();
+        owned.clear();
+    };
+
+    bool damaged = false;
+    for (unsigned int i = 0; i < header.records; i++)
+    {
+        //where the file was is meaningless here, it is laid out again
+        Entry entry;
+        Entry *pE = &entry;
+        in.read((char*)&entry, sizeof(Entry));
+        bool wrapped = entry.flags & ENTRY_WRAPPED_KEY;
+        bool sparse = (entry.flags & ENTRY_MAPPED) && !entry.hasPassword;
+        entry.flags &= ENTRY_INLINE | ENTRY_WRAPPED_KEY;
+        entry.startingCluster = 0;
+        entry.mapCluster = 0;
+        entry.extraSlots = 0;
+        std::fill(entry.reserved, entry.reserved + sizeof(entry.reserved), 0);
+
+        std::string data;
+        std::vector<unsigned int> clusters;
+        bool read = true, consumed = true;
+        if (entry.flags & ENTRY_INLINE)
+        {
+            data.assign(entry.fileSize, 0);
+            read = (bool)in.read(&data[0], data.size());
+            entry.extraSlots = (entry.fileSize + INLINE_SLOT_SIZE - 1) / INLINE_SLOT_SIZE;
+        }
+        else if (sparse)
+        {
+            //file is read whole so its all-zero clusters are found again
+            std::string content(entry.fileSize, 0);
+            read = (bool)in.read(&content[0], content.size());
+            if (read)
+                clusters = AllocateFileClusters(pE, content, false);
+            if (!clusters.empty())
+                WriteFileContent(content, clusters);
+        }
+        else
+        {
+            read = WriteStreamedContent(pE, [&in](char *buffer, size_t size) { return (bool)in.read(buffer, size); }, clusters);
+            consumed = !clusters.empty();
+        }
+        std::string keySlot(wrapped ? KEY_SLOT_SIZE : 0, 0);
+        if (read && wrapped)
+            read = (bool)in.read(&keySlot[0], keySlot.size());
+        if (!read)
+        {
+            FreeClusters(clusters);
+            damaged = true;
+            break;
+        }
+        if (!(entry.flags & ENTRY_INLINE) && clusters.empty())
+        {
+            std::cout << "Out of clusters for file " << entry.GetFullName() << '\n';
+            skipped++;
+            if (!consumed)
+                in.seekg(entry.fileSize, std::ios::cur);
+            continue;
+        }
+
+        if (entry.flags & ENTRY_EXTENTS)
+            data = EncodeExtents(clusters);
+        if (wrapped)
+        {
+            data.resize(entry.extraSlots * INLINE_SLOT_SIZE, 0);
+            data += keySlot;
+            entry.extraSlots++;
+        }
+        entry.generation = ++fsInfo.generation;
+        entries.push_back(entry);
+        fileNames.push_back(std::string(entry.name, entry.name + entry.nameLen));
+        slotData.push_back(data);
+        //cluster map of a sparse file is owned too, holes are not
+        owned.push_back(entry.flags & ENTRY_MAPPED ? GetAllocatedClusters(pE, 0) : clusters);
+        if (entries.size() == INGEST_BATCH)
+            writeBatch();
+    }
+    writeBatch();
+
+    if (damaged)
+        std::cout << "Backup is damaged or truncated, files before the damage are restored\n";
+    std::cout << "Backup of generation " << header.generation << ": restored " << restored << " files, deleted " << deleted << " files";
+    if (skipped)
+        std::cout << ", skipped " << skipped << " files";
+    std::cout << '\n';
+    return !damaged && skipped == 0;
+}
+
+void MyFileSystem::RestoreBackups(const std::vector<std::string>& archivePaths)
+{
+    //whole chain is checked before anything changes
+    std::vector<std::ifstream> archives;
+    std::vector<BackupHeader> headers;
+    for (const std::string& path : archivePaths)
+    {
+        archives.emplace_back(path, std::ios::binary | std::ios::in);
+        BackupHeader header;
+        header.signature = 0;
+        archives.back().read((char*)&header, sizeof(BackupHeader));
+        if (!archives.back() || header.signature != BACKUP_SIGNATURE)
+        {
+            std::cout << path << " is not a backup file!\n";
+            return;
+        }
+        if (!headers.empty() && header.baseGeneration != headers.back().generation)
+        {
+            std::cout << path << " follows generation " << header.baseGeneration << ", not " << headers.back().generation << " of the backup before it!\n";
+            return;
+        }
+        headers.push_back(header);
+    }
+    if (headers.empty())
+        return;
+    if (headers[0].baseGeneration != 0)
+        std::cout << "First backup is incremental, files it did not change are kept as they are in the volume\n";
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < archives.size(); i++)
+    {
+        if (!ApplyBackup(archives[i], headers[i]))
+        {
+            if (i + 1 < archives.size())
+                std::cout << "Backups after " << archivePaths[i] << " are not applied\n";
+            return;
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Files match generation " << headers.back().generation << " of the backed up volume, " << std::fixed << std::setprecision(2)
+        << elapsed << " s\n";
+    std::cout.unsetf(std::ios::fixed);
+}
+
+void MyFileSystem::BackupSettings()
+{
+    std::cout << "Volume is at generation " << fsInfo.generation << '\n';
+    int choice;
+    std::cout << "Enter 1 - back up files, 2 - restore from backups, 0 - back: ";
+    std::cin >> choice;
+    std::cin.ignore();
+    if (choice == 1)
+    {
+        unsigned int generation;
+        std::cout << "Enter generation of the previous backup, 0 - back up every file: ";
+        std::cin >> generation;
+        std::cin.ignore();
+        std::string path;
+        std::cout << "Enter backup file path: ";
+        std::getline(std::cin, path);
+        BackUpFiles(generation, path);
+    }
+    else if (choice == 2)
+    {
+        std::vector<std::string> paths;
+        std::string path;
+        std::cout << "Enter backup file paths from the full backup to the latest one, empty line to end:\n";
+        while (std::getline(std::cin, path) && !path.empty())
+            paths.push_back(path);
+        RestoreBackups(paths);
+    }
+}
@@ -0,0 +1,258 @@
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include "MyFileSystem.h"
+
+void MyFileSystem::RunCrashOperations(MyFileSystem& fs, unsigned int seed, unsigned int count, const std::vector<std::string>& files,
+    const std::vector<std::string>& keys, const std::string& tarPath, const std::string& backupPath)
+{
+    std::mt19937 rng(seed);
+    //key of a protected file is the one whose hash it stores
+    auto keyOf = [&](Entry& e)
+    {
+        for (const std::string& key : keys)
+        {
+            if (fs.GenerateHash(key) == std::string(e.hashedPassword, e.hashedPassword + 32))
+                return key;
+        }
+        return keys[0];
+    };
+    //half of the sequences append at the log head and clean segments
+    fs.logMode = seed % 2;
+    //each backup is based on the one before it, so any prefix of them can be restored
+    std::vector<std::string> backups;
+    unsigned int backupGeneration = 0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        std::vector<std::pair<std::string, unsigned int>> fileList = fs.GetFileList();
+        std::vector<std::pair<std::string, unsigned int>> deletedList = fs.GetFileList(true);
+        unsigned int operation = rng() % 15;
+        if (operation < 3 || fileList.empty())
+            fs.ImportFile(files[rng() % files.size()], rng() % 3 == 0 ? keys[rng() % keys.size()] : "");
+        else if (operation < 5)
+        {
+            unsigned int offset = fileList[rng() % fileList.size()].second;
+            Entry e;
+            fs.ReadAt(offset, (char*)&e, sizeof(Entry));
+            fs.MyDeleteFile(offset, rng() % 2, e.hasPassword ? keyOf(e) : "");
+        }
+        else if (operation == 5 && !deletedList.empty())
+            fs.RestoreFile(deletedList[rng() % deletedList.size()].second);
+        else if (operation == 6)
+            fs.CloneFile(fileList[rng() % fileList.size()].second);
+        else if (operation == 7)
+            fs.BulkDelete("*file" + std::to_string(rng() % files.size()) + "*", rng() % 2, keys[rng() % keys.size()]);
+        //what the background reclaimer does between operations
+        else if (operation == 8)
+            fs.ReclaimClusters();
+        else if (operation == 9)
+            fs.CleanSegments(LOG_CLEAN_PERCENT);
+        //protect, rewrap the data key or remove protection, each of them moves the entry
+        else if (operation == 10)
+        {
+            unsigned int offset = fileList[rng() % fileList.size()].second;
+            Entry e;
+            fs.ReadAt(offset, (char*)&e, sizeof(Entry));
+            Entry *pE = &e;
+            std::string newKey = keys[rng() % keys.size()];
+            fs.SetFileKey(pE, offset, e.hasPassword ? keyOf(e) : "", e.hasPassword && rng() % 2 ? "" : newKey);
+        }
+        //move every file protected by one key to the other
+        else if (operation == 13)
+        {
+            unsigned int from = rng() % keys.size();
+            fs.BulkChangePassword("*", keys[from], keys[(from + 1) % keys.size()]);
+        }
+        else if (operation == 11)
+            fs.IngestTar(tarPath);
+        else if (operation == 12)
+        {
+            unsigned int generation = fs.fsInfo.generation;
+            backups.push_back(backupPath + std::to_string(backups.size()));
+            fs.BackUpFiles(backupGeneration, backups.back());
+            backupGeneration = generation;
+        }
+        else if (!backups.empty())
+            fs.RestoreBackups(std::vector<std::string>(backups.begin(), backups.begin() + 1 + rng() % backups.size()));
+    }
+}
+
+void MyFileSystem::CrashTest(const std::string& path, unsigned int scenarios, unsigned int seed, unsigned int operations, void (*createVolume)(const std::string&),
+    void (*createStripedVolume)(const std::string&, unsigned int, unsigned int))
+{
+    std::mt19937 rng(seed);
+
+    //host files of different sizes so imported files can be matched by size
+    //small ones are stored inline, large ones as extents, the zero-filled one as a sparse map
+    const unsigned int sizes[] = { 100, 900, 3000, 9000, 70000, 150000, 300000 };
+    std::vector<std::string> files;
+    std::map<unsigned int, std::string> sources;
+    for (unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        std::string data(sizes[i], 0);
+        if (i != 4)
+        {
+            for (char& c : data)
+                c = (char)(rng() % 256);
+        }
+        files.push_back(path + ".file" + std::to_string(i) + ".bin");
+        std::ofstream out(files.back(), std::ios::binary | std::ios::out | std::ios::trunc);
+        out.write(&data[0], data.size());
+        sources[sizes[i]] = data;
+    }
+    const std::string exportPath = path + ".export";
+
+    //tar archive of an inline, a chained and an extents file for ingest
+    const std::string tarPath = path + ".tar";
+    std::ofstream tar(tarPath, std::ios::binary | std::ios::out | std::ios::trunc);
+    for (unsigned int i : { 1u, 3u, 5u })
+    {
+        std::string header(TAR_BLOCK, 0);
+        files[i].substr(files[i].find_last_of("/\\") + 1).copy(&header[0], 99);
+        snprintf(&header[100], 8, "%07o", 0644);
+        snprintf(&header[124], 12, "%011o", sizes[i]);
+        header[156] = '0';
+        memcpy(&header[257], "ustar\0" "00", 8);
+        header.replace(148, 8, 8, ' ');
+        unsigned int checksum = 0;
+        for (char c : header)
+            checksum += (byte)c;
+        snprintf(&header[148], 7, "%06o", checksum);
+        tar.write(&header[0], header.size());
+        tar.write(&sources[sizes[i]][0], sizes[i]);
+        tar.write(std::string((TAR_BLOCK - sizes[i] % TAR_BLOCK) % TAR_BLOCK, 0).c_str(), (TAR_BLOCK - sizes[i] % TAR_BLOCK) % TAR_BLOCK);
+    }
+    tar.write(std::string(2 * TAR_BLOCK, 0).c_str(), 2 * TAR_BLOCK);
+    tar.close();
+    const std::string backupPath = path + ".backup";
+    //protected files get one of two passwords, bulk changes move them between the two
+    std::vector<std::string> keys;
+
+    unsigned int failed = 0;
+    double totalMount = 0, minMount = 1e9, maxMount = 0;
+    for (unsigned int scenario = 1; scenario <= scenarios; scenario++)
+    {
+        unsigned int operationSeed = rng();
+        //half of the scenarios stripe the volume across 2 to 4 files with small units so runs cross many files
+        unsigned int stripes = rng() % 2 ? 2 + rng() % 3 : 1;
+        unsigned int stripeUnit = 1 + rng() % 4;
+        auto create = [&]()
+        {
+            if (stripes > 1)
+                createStripedVolume(path, stripes, stripeUnit);
+            else createVolume(path);
+        };
+        //operations print their own messages, keep the report readable
+        std::streambuf *console = std::cout.rdbuf(nullptr);
+
+        //count host writes of the whole sequence, then crash a new volume at one of them
+        create();
+        unsigned long long mountWrites, totalWrites;
+        {
+            MyFileSystem fs(path);
+            if (keys.empty())
+                keys = { fs.GenerateHash("crash"), fs.GenerateHash("crash2") };
+            mountWrites = fs.hostWrites;
+            RunCrashOperations(fs, operationSeed, operations, files, keys, tarPath, backupPath);
+            totalWrites = fs.hostWrites;
+        }
+        unsigned long long crashPoint = mountWrites + rng() % std::max<unsigned long long>(totalWrites - mountWrites, 1);
+        bool torn = rng() % 2;
+
+        create();
+        {
+            MyFileSystem fs(path);
+            fs.writesLeft = crashPoint - mountWrites;
+            fs.tearWrite = torn;
+            try
+            {
+                RunCrashOperations(fs, operationSeed, operations, files, keys, tarPath, backupPath);
+            }
+            catch (const SimulatedCrash&) {}
+        }
+
+        //remount runs recovery
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        MyFileSystem fs(path);
+        double mountTime = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        VolumeCheck check = fs.CheckVolume();
+
+        //every file left must have the content of the host file it came from
+        unsigned int corrupted = 0;
+        std::vector<std::pair<std::string, unsigned int>> fileList = fs.GetFileList();
+        for (const std::pair<std::string, unsigned int>& file : fileList)
+        {
+            Entry e;
+            fs.ReadAt(file.second, (char*)&e, sizeof(Entry));
+            Entry *pE = &e;
+            std::remove((exportPath + e.GetFullName()).c_str());
+            //a hash that matches neither key, or a wrapped key that does not open with it, fails the export
+            std::string key;
+            for (const std::string& k : keys)
+            {
+                if (fs.GenerateHash(k) == std::string(e.hashedPassword, e.hashedPassword + 32))
+                    key = k;
+            }
+            if (e.hasPassword && key.empty())
+            {
+                corrupted++;
+                continue;
+            }
+            fs.ExportFile(exportPath, pE, file.second, key);
+
+            std::ifstream in(exportPath + e.GetFullName(), std::ios::binary | std::ios::in);
+            std::string data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            if (sources.count(e.fileSize) == 0 || sources[e.fileSize] != data)
+                corrupted++;
+            in.close();
+            std::remove((exportPath + e.GetFullName()).c_str());
+        }
+        std::cout.rdbuf(console);
+
+        bool ok = check.leaked.empty() && check.orphanSlots.empty() && check.unmarked.empty() && check.miscounted.empty() && check.badEntries == 0 && !check.freeSpaceMismatch && corrupted == 0;
+        if (!ok)
+            failed++;
+        totalMount += mountTime;
+        minMount = std::min(minMount, mountTime);
+        maxMount = std::max(maxMount, mountTime);
+
+        std::cout << "Scenario " << scenario << ": crash at write " << crashPoint - mountWrites + 1 << '/' << totalWrites - mountWrites
+            << (torn ? " (torn)" : " (dropped)");
+        if (stripes > 1)
+            std::cout << " on " << stripes << " stripes";
+        std::cout << ", " << fileList.size() << " files, freed " << fs.recoveredClusters
+            << " clusters, mount " << std::fixed << std::setprecision(1) << mountTime << " ms";
+        if (ok)
+            std::cout << ", OK\n";
+        else
+        {
+            std::cout << ", FAILED:";
+            if (!check.leaked.empty())
+                std::cout << ' ' << check.leaked.size() << " leaked";
+            if (!check.orphanSlots.empty())
+                std::cout << ' ' << check.orphanSlots.size() << " orphan slots";
+            if (!check.unmarked.empty())
+                std::cout << ' ' << check.unmarked.size() << " unmarked";
+            if (!check.miscounted.empty())
+                std::cout << ' ' << check.miscounted.size() << " miscounted";
+            if (check.badEntries)
+                std::cout << ' ' << check.badEntries << " bad entries";
+            if (check.freeSpaceMismatch)
+                std::cout << " free space mismatch";
+            if (corrupted)
+                std::cout << ' ' << corrupted << " corrupted files";
+            std::cout << '\n';
+        }
+    }
+
+    for (const std::string& file : files)
+        std::remove(file.c_str());
+    std::remove(tarPath.c_str());
+    for (unsigned int i = 0; i < operations; i++)
+        std::remove((backupPath + std::to_string(i)).c_str());
+    for (unsigned int i = 0; i <= 4; i++)
+        std::remove(StripePath(path, i).c_str());
+    std::cout << scenarios - failed << '/' << scenarios << " scenarios recovered, mount time min " << std::fixed << std::setprecision(1)
+        << minMount << " ms, avg " << totalMount / std::max(scenarios, 1u) << " ms, max " << maxMount << " ms\n";
+}
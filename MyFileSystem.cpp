@@ -1,13 +1,337 @@
 #include "MyFileSystem.h"
+#include <algorithm>
+#include <climits>
+#include <cstddef>
+#include <cerrno>
+#include <cstring>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#endif
+
+void MyFileSystem::ReadAt(unsigned int offset, char *buffer, unsigned int size)
+{
+    if (size == 0)
+        return;
+    unsigned int first = offset / CACHE_BLOCK_SIZE;
+    unsigned int last = (offset + size - 1) / CACHE_BLOCK_SIZE;
+
+    if (cacheBudget == 0 || size >= CACHE_BYPASS_SIZE)
+    {
+        ReadHost(offset, buffer, size);
+
+        //dirty blocks are newer than the volume
+        for (std::set<unsigned int>::iterator it = dirtyBlocks.lower_bound(first); it != dirtyBlocks.end() && *it <= last; it++)
+        {
+            unsigned int blockStart = *it * CACHE_BLOCK_SIZE;
+            unsigned int from = std::max(offset, blockStart);
+            unsigned int to = std::min(offset + size, blockStart + CACHE_BLOCK_SIZE);
+            memcpy(buffer + (from - offset), &cache[*it].data[from - blockStart], to - from);
+        }
+        return;
+    }
+
+    for (unsigned int block = first; block <= last; block++)
+    {
+        CacheBlock& cacheBlock = GetCacheBlock(block, true);
+        unsigned int blockStart = block * CACHE_BLOCK_SIZE;
+        unsigned int from = std::max(offset, blockStart);
+        unsigned int to = std::min(offset + size, blockStart + CACHE_BLOCK_SIZE);
+        memcpy(buffer + (from - offset), &cacheBlock.data[from - blockStart], to - from);
+    }
+}
+
+void MyFileSystem::WriteAt(unsigned int offset, const char *buffer, unsigned int size)
+{
+    if (size == 0)
+        return;
+    unsigned int first = offset / CACHE_BLOCK_SIZE;
+    unsigned int last = (offset + size - 1) / CACHE_BLOCK_SIZE;
+
+    if (cacheBudget == 0 || size >= CACHE_BYPASS_SIZE)
+    {
+        WriteHost(offset, buffer, size);
+
+        //keep cached copies up to date
+        for (unsigned int block = first; block <= last && !cache.empty(); block++)
+        {
+            std::unordered_map<unsigned int, CacheBlock>::iterator it = cache.find(block);
+            if (it == cache.end())
+                continue;
+            unsigned int blockStart = block * CACHE_BLOCK_SIZE;
+            unsigned int from = std::max(offset, blockStart);
+            unsigned int to = std::min(offset + size, blockStart + CACHE_BLOCK_SIZE);
+            memcpy(&it->second.data[from - blockStart], buffer + (from - offset), to - from);
+        }
+        return;
+    }
+
+    for (unsigned int block = first; block <= last; block++)
+    {
+        unsigned int blockStart = block * CACHE_BLOCK_SIZE;
+        unsigned int from = std::max(offset, blockStart);
+        unsigned int to = std::min(offset + size, blockStart + CACHE_BLOCK_SIZE);
+        //a block that is overwritten completely does not need to be read
+        bool whole = from == blockStart && to == blockStart + CACHE_BLOCK_SIZE;
+        CacheBlock& cacheBlock = GetCacheBlock(block, !whole);
+        memcpy(&cacheBlock.data[from - blockStart], buffer + (from - offset), to - from);
+        dirtyBlocks.insert(block);
+    }
+}
+
+void MyFileSystem::Flush()
+{
+    //consecutive dirty blocks are written at once
+    std::set<unsigned int>::iterator it = dirtyBlocks.begin();
+    while (it != dirtyBlocks.end())
+    {
+        unsigned int first = *it;
+        std::vector<char> run;
+        unsigned int expected = first;
+        while (it != dirtyBlocks.end() && *it == expected)
+        {
+            std::vector<char>& data = cache[*it].data;
+            run.insert(run.end(), data.begin(), data.end());
+            expected++;
+            it++;
+        }
+        WriteHost(first * CACHE_BLOCK_SIZE, &run[0], run.size());
+        //written blocks are clean even if a later write fails
+        dirtyBlocks.erase(dirtyBlocks.begin(), it);
+    }
+    f.flush();
+    for (std::fstream& stripe : stripeFiles)
+        stripe.flush();
+}
+
+void MyFileSystem::WriteHost(unsigned int offset, const char *buffer, unsigned int size)
+{
+    hostWrites++;
+    if (writesLeft == 0)
+    {
+        //torn write reaches the volume sector by sector, only the first half of them made it
+        //backing files are written in parallel, so each of them keeps the first half of its own part
+        if (tearWrite)
+        {
+            std::vector<HostRun> runs = MapHostRange(offset, size);
+            for (unsigned int file = 0; file < stripeCount; file++)
+            {
+                unsigned int total = 0;
+                for (const HostRun& run : runs)
+                    total += run.file == file ? run.size : 0;
+                unsigned int kept = total / 2 / bytesPerSector * bytesPerSector;
+                std::fstream& out = HostFile(file);
+                for (const HostRun& run : runs)
+                {
+                    if (run.file != file || kept == 0)
+                        continue;
+                    out.seekp(run.offset, out.beg);
+                    out.write(buffer + run.position, std::min(run.size, kept));
+                    kept -= std::min(run.size, kept);
+                }
+            }
+        }
+        f.flush();
+        for (std::fstream& stripe : stripeFiles)
+            stripe.flush();
+        crashed = true;
+        throw SimulatedCrash();
+    }
+    if (writesLeft > 0)
+        writesLeft--;
+    WriteStripes(offset, buffer, size);
+}
+
+std::vector<MyFileSystem::HostRun> MyFileSystem::MapHostRange(unsigned int offset, unsigned int size)
+{
+    std::vector<HostRun> runs;
+    const unsigned int dataStart = (sectorsBeforeFat + fatSize) * bytesPerSector;
+    const unsigned int unitSize = stripeUnit * bytesPerSector * sectorsPerCluster;
+    unsigned int position = 0;
+    while (position < size)
+    {
+        unsigned int current = offset + position;
+        HostRun run = { 0, current, position, size - position };
+        if (stripeCount > 1 && current >= dataStart)
+        {
+            //units go round robin, unit i is in file i % count at row i / count
+            unsigned int unit = (current - dataStart) / unitSize;
+            unsigned int within = (current - dataStart) % unitSize;
+            run.file = unit % stripeCount;
+            run.offset = (unit / stripeCount) * unitSize + within + (run.file == 0 ? dataStart : 0);
+            run.size = std::min(run.size, unitSize - within);
+        }
+        else if (stripeCount > 1)
+            run.size = std::min(run.size, dataStart - current);
+        runs.push_back(run);
+        position += run.size;
+    }
+    return runs;
+}
+
+std::fstream& MyFileSystem::HostFile(unsigned int file)
+{
+    return file == 0 ? f : stripeFiles[file - 1];
+}
+
+int MyFileSystem::HostFd(unsigned int file)
+{
+    return file == 0 ? fd : stripeFds[file - 1];
+}
+
+void MyFileSystem::ForEachStripe(const std::vector<HostRun>& runs, unsigned int size, const std::function<void(unsigned int)>& work)
+{
+    std::vector<unsigned int> files;
+    for (const HostRun& run : runs)
+    {
+        if (std::find(files.begin(), files.end(), run.file) == files.end())
+            files.push_back(run.file);
+    }
+
+    //each backing file has its own stream, so files can be served by different threads
+    if (files.size() == 1 || size < CACHE_BYPASS_SIZE)
+    {
+        for (unsigned int file : files)
+            work(file);
+        return;
+    }
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < files.size(); i++)
+        threads.emplace_back(work, files[i]);
+    work(files[0]);
+    for (std::thread& thread : threads)
+        thread.join();
+}
+
+void MyFileSystem::ReadHost(unsigned int offset, char *buffer, unsigned int size, std::vector<std::ifstream> *streams)
+{
+    std::vector<HostRun> runs = MapHostRange(offset, size);
+    ForEachStripe(runs, size, [&](unsigned int file)
+    {
+        std::istream& in = streams ? (std::istream&)(*streams)[file] : (std::istream&)HostFile(file);
+        for (const HostRun& run : runs)
+        {
+            if (run.file != file)
+                continue;
+            in.seekg(run.offset, in.beg);
+            in.read(buffer + run.position, run.size);
+        }
+    });
+}
+
+void MyFileSystem::WriteStripes(unsigned int offset, const char *buffer, unsigned int size)
+{
+    std::vector<HostRun> runs = MapHostRange(offset, size);
+    ForEachStripe(runs, size, [&](unsigned int file)
+    {
+        std::fstream& out = HostFile(file);
+        for (const HostRun& run : runs)
+        {
+            if (run.file != file)
+                continue;
+            out.seekp(run.offset, out.beg);
+            out.write(buffer + run.position, run.size);
+        }
+    });
+}
+
+std::vector<std::ifstream> MyFileSystem::OpenStreams()
+{
+    std::vector<std::ifstream> streams;
+    for (unsigned int i = 0; i < stripeCount; i++)
+    {
+        streams.emplace_back(StripePath(volumePath, i), std::ios::binary | std::ios::in);
+        if (!streams.back())
+            return std::vector<std::ifstream>();
+    }
+    return streams;
+}
+
+std::string MyFileSystem::StripePath(const std::string& path, unsigned int index)
+{
+    if (index == 0)
+        return path;
+    return path + '.' + std::to_string(index);
+}
+
+MyFileSystem::CacheBlock& MyFileSystem::GetCacheBlock(unsigned int block, bool load)
+{
+    std::unordered_map<unsigned int, CacheBlock>::iterator it = cache.find(block);
+    if (it != cache.end())
+    {
+        cacheHits++;
+        CacheBlock& cacheBlock = it->second;
+        if (cacheBlock.isProtected)
+        {
+            protectedBlocks.splice(protectedBlocks.begin(), protectedBlocks, cacheBlock.position);
+            return cacheBlock;
+        }
+
+        //second reference, promote block
+        probation.erase(cacheBlock.position);
+        protectedBlocks.push_front(block);
+        cacheBlock.position = protectedBlocks.begin();
+        cacheBlock.isProtected = true;
+
+        //protected segment gives its least recent block back to probation
+        size_t protectedLimit = cacheBudget - cacheBudget * CACHE_PROBATION_PERCENT / 100;
+        if (protectedBlocks.size() > protectedLimit)
+        {
+            unsigned int demoted = protectedBlocks.back();
+            protectedBlocks.pop_back();
+            probation.push_front(demoted);
+            cache[demoted].position = probation.begin();
+            cache[demoted].isProtected = false;
+        }
+        return cacheBlock;
+    }
+
+    cacheMisses++;
+    EvictCacheBlocks(cacheBudget - 1);
+    CacheBlock& cacheBlock = cache[block];
+    cacheBlock.data.assign(CACHE_BLOCK_SIZE, 0);
+    if (load)
+        ReadHost(block * CACHE_BLOCK_SIZE, &cacheBlock.data[0], CACHE_BLOCK_SIZE);
+    probation.push_front(block);
+    cacheBlock.position = probation.begin();
+    return cacheBlock;
+}
+
+void MyFileSystem::EvictCacheBlocks(size_t limit)
+{
+    while (cache.size() > limit)
+    {
+        //probation keeps its share, the rest is taken from protected blocks
+        bool fromProbation = !probation.empty() && (protectedBlocks.empty() || probation.size() * 100 >= cacheBudget * CACHE_PROBATION_PERCENT);
+        unsigned int victim = fromProbation ? probation.back() : protectedBlocks.back();
+        if (fromProbation)
+            probation.pop_back();
+        else protectedBlocks.pop_back();
+
+        if (dirtyBlocks.erase(victim))
+            WriteHost(victim * CACHE_BLOCK_SIZE, &cache[victim].data[0], CACHE_BLOCK_SIZE);
+        cache.erase(victim);
+    }
+}
 
 std::vector<char> MyFileSystem::ReadBlock(unsigned int offset, unsigned int size)
 {
-    f.seekg(offset, f.beg);
     std::vector<char> buffer(size, 0);
-    f.read(&buffer[0], size);
+    ReadAt(offset, &buffer[0], size);
     return buffer;
 }
 
+unsigned int MyFileSystem::GetClusterOffset(unsigned int cluster)
+{
+    return (sectorsBeforeFat + fatSize + sectorsPerCluster * (cluster - STARTING_CLUSTER)) * bytesPerSector;
+}
+
 //hashing using PKCS5_PBKDF2_HMAC with SHA256
 //https://www.cryptopp.com/wiki/PKCS5_PBKDF2_HMAC
 //sample program 1
@@ -91,12 +415,63 @@ void MyFileSystem::DecryptData(std::string& data, const std::string& key, Entry
     delete[] decrypted;
 }
 
+std::string MyFileSystem::WrapKey(const std::string& dataKey, const std::string& key)
+{
+    using namespace CryptoPP;
+
+    //random nonce since many files share a password
+    byte nonce[WRAP_NONCE_SIZE];
+    AutoSeededRandomPool prng;
+    prng.GenerateBlock(nonce, sizeof(nonce));
+
+    std::string keySlot((char*)nonce, (char*)nonce + sizeof(nonce));
+    keySlot.resize(KEY_SLOT_SIZE, 0);
+    XChaCha20Poly1305::Encryption enc;
+    enc.SetKeyWithIV((byte*)key.c_str(), key.size(), nonce, sizeof(nonce));
+    enc.EncryptAndAuthenticate((byte*)&keySlot[WRAP_NONCE_SIZE], (byte*)&keySlot[WRAP_NONCE_SIZE + DATA_KEY_SIZE], KEY_SLOT_SIZE - WRAP_NONCE_SIZE - DATA_KEY_SIZE,
+        nonce, sizeof(nonce), nullptr, 0, (byte*)dataKey.c_str(), dataKey.size());
+    return keySlot;
+}
+
+bool MyFileSystem::UnwrapKey(const std::string& keySlot, const std::string& key, std::string& dataKey)
+{
+    using namespace CryptoPP;
+
+    const byte *nonce = (const byte*)keySlot.c_str();
+    dataKey.assign(DATA_KEY_SIZE, 0);
+    XChaCha20Poly1305::Decryption dec;
+    dec.SetKeyWithIV((byte*)key.c_str(), key.size(), nonce, WRAP_NONCE_SIZE);
+    return dec.DecryptAndVerify((byte*)&dataKey[0], nonce + WRAP_NONCE_SIZE + DATA_KEY_SIZE, KEY_SLOT_SIZE - WRAP_NONCE_SIZE - DATA_KEY_SIZE,
+        nonce, WRAP_NONCE_SIZE, nullptr, 0, nonce + WRAP_NONCE_SIZE, DATA_KEY_SIZE);
+}
+
+std::string MyFileSystem::ReadKeySlot(Entry *&entry, unsigned int offset)
+{
+    std::vector<char> keySlot = ReadBlock(offset + entry->extraSlots * sizeof(Entry) + 1, KEY_SLOT_SIZE);
+    return std::string(keySlot.begin(), keySlot.end());
+}
+
+bool MyFileSystem::GetDataKey(Entry *&entry, unsigned int offset, const std::string& key, std::string& dataKey)
+{
+    if (!(entry->flags & ENTRY_WRAPPED_KEY))
+    {
+        dataKey = key;
+        return true;
+    }
+
+    if (!UnwrapKey(ReadKeySlot(entry, offset), key, dataKey))
+    {
+        std::cout << "Key of file " << entry->GetFullName() << " is damaged!\n";
+        return false;
+    }
+    return true;
+}
+
 void MyFileSystem::CreateFSPassword()
 {    
     //write password byte in boot sector
-    f.seekp(10, f.beg);
     bool hasPassword = true;
-    f.write((char*)&hasPassword, 1);
+    WriteAt(10, (char*)&hasPassword, 1);
     this->hasPassword = hasPassword;
     
     //input password
@@ -108,17 +483,15 @@ void MyFileSystem::CreateFSPassword()
     std::string hashedPassword = GenerateHash(password);
 
     //write hashed password to volume
-    f.seekp(32, f.beg);
-    f.write(hashedPassword.c_str(), hashedPassword.size());
+    WriteAt(32, hashedPassword.c_str(), hashedPassword.size());
 
-    f.flush();
+    Flush();
 }
 
 bool MyFileSystem::CheckFSPassword(const std::string& password)
 {
-    f.seekg(32, f.beg);
     std::string encrypedPassword(32, 0);
-    f.read(&encrypedPassword[0], 32);
+    ReadAt(32, &encrypedPassword[0], 32);
 
     return encrypedPassword == GenerateHash(password);
 }
@@ -139,7 +512,12 @@ void MyFileSystem::ChangeFSPassword()
     CreateFSPassword();
 }
 
-bool MyFileSystem::CheckFSPassword()
+bool MyFileSystem::IsMounted() const
+{
+    return mounted;
+}
+
+bool MyFileSystem::CheckFSPassword(std::istream& input)
 {
     if (hasPassword)
     {
@@ -148,8 +526,9 @@ bool MyFileSystem::CheckFSPassword()
         do
         {
             std::cout << "Enter password to access file system: ";
-            std::cin >> password;
-            std::cin.ignore();
+            if (!(input >> password))
+                return false;
+            input.ignore();
             if (!CheckFSPassword(password))
             {
                 std::cout << "Incorrect password!\n";
@@ -165,21 +544,106 @@ bool MyFileSystem::CheckFSPassword()
     return true;
 }
 
-MyFileSystem::MyFileSystem()
+MyFileSystem::MyFileSystem(const std::string& path) : volumePath(path)
 {
-    f.open(FS_PATH, std::ios::binary | std::ios::in | std::ios::out);
+    f.open(volumePath, std::ios::binary | std::ios::in | std::ios::out);
     //read boot sector
-    f.read((char*)&bytesPerSector, 2);
-    f.read((char*)&sectorsPerCluster, 1);
-    f.read((char*)&sectorsBeforeFat, 1);
-    f.read((char*)&fatSize, 2);
-    f.read((char*)&volumeSize, 4);
-    f.read((char*)&hasPassword, 1);
+    ReadAt(0, (char*)&bytesPerSector, 2);
+    ReadAt(2, (char*)&sectorsPerCluster, 1);
+    ReadAt(3, (char*)&sectorsBeforeFat, 1);
+    ReadAt(4, (char*)&fatSize, 2);
+    ReadAt(6, (char*)&volumeSize, 4);
+    ReadAt(10, (char*)&hasPassword, 1);
+    ReadAt(PUNCH_HOLES_OFFSET, (char*)&punchHoles, 1);
+    ReadAt(SHARE_TABLE_OFFSET, (char*)&shareTableCluster, 4);
+    ReadAt(CHECKSUM_TABLE_OFFSET, (char*)&checksumTableCluster, 4);
+    ReadAt(LOG_MODE_OFFSET, (char*)&logMode, 1);
+
+    //boot sector is in the volume file itself, the rest of the stripes are opened before any data is read
+    //a missing one would lose every write to it, so the volume is not mounted
+    byte stripes = 0;
+    ReadAt(STRIPE_COUNT_OFFSET, (char*)&stripes, 1);
+    ReadAt(STRIPE_UNIT_OFFSET, (char*)&stripeUnit, 4);
+    if (stripes > 1 && stripeUnit != 0)
+        stripeCount = stripes;
+    for (unsigned int i = 1; i < stripeCount; i++)
+    {
+        stripeFiles.emplace_back(StripePath(volumePath, i), std::ios::binary | std::ios::in | std::ios::out);
+        if (!stripeFiles.back())
+        {
+            std::cout << "Backing file " << StripePath(volumePath, i) << " is missing, volume is not mounted!\n";
+            return;
+        }
+    }
+
+#ifdef __linux__
+    fd = open(volumePath.c_str(), O_RDWR);
+    for (unsigned int i = 1; i < stripeCount; i++)
+        stripeFds.push_back(open(StripePath(volumePath, i).c_str(), O_RDWR));
+#endif
+
+    //volume stays marked unclean while it is open
+    ReadAt(FSINFO_OFFSET, (char*)&fsInfo, sizeof(FSInfo));
+    bool unclean = fsInfo.signature == FSINFO_SIGNATURE && !fsInfo.clean;
+    if (fsInfo.signature != FSINFO_SIGNATURE || !fsInfo.clean)
+    {
+        if (unclean)
+            std::cout << "File system was not closed properly, checking it\n";
+        RebuildFSInfo();
+    }
+    fsInfo.clean = 0;
+    WriteAt(FSINFO_OFFSET, (char*)&fsInfo, sizeof(FSInfo));
+    Flush();
+
+    //an existing table is loaded on first use, only a volume without one is read through now
+    if (checksumTableCluster == 0 && !LoadChecksums(true))
+        std::cout << "Out of space for cluster checksums, data will not be verified!\n";
+    if (unclean)
+        RepairVolume();
+    mounted = true;
 }
 
 MyFileSystem::~MyFileSystem()
 {
+    if (scrubThread.joinable())
+    {
+        scrubStop = true;
+        scrubThread.join();
+    }
+    if (reclaimThread.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(volumeMutex);
+            reclaimStop = true;
+        }
+        reclaimWake.notify_one();
+        reclaimThread.join();
+    }
+    //after a simulated crash or a failed mount nothing more reaches the volume
+    if (!crashed && mounted)
+    {
+        try
+        {
+            ReclaimClusters();
+        }
+        catch (const SimulatedCrash&) {}
+    }
+    if (!crashed && mounted)
+    {
+        fsInfo.clean = 1;
+        WriteAt(FSINFO_OFFSET, (char*)&fsInfo, sizeof(FSInfo));
+        Flush();
+    }
     f.close();
+#ifdef __linux__
+    if (fd != -1)
+        close(fd);
+    for (int stripeFd : stripeFds)
+    {
+        if (stripeFd != -1)
+            close(stripeFd);
+    }
+#endif
 }
 
 bool MyFileSystem::CheckDuplicateName(Entry *&entry)
@@ -193,8 +657,8 @@ bool MyFileSystem::CheckDuplicateName(Entry *&entry)
         for (; bytesOffset < limitOffset; bytesOffset += sizeof(Entry))
         {
             std::vector<char> tempEntry = ReadBlock(bytesOffset, sizeof(Entry));
-            //sign of erased file
-            if (tempEntry[0] == -27)
+            //sign of erased file or data of previous entry
+            if (tempEntry[0] == -27 || tempEntry[0] == ENTRY_CONTINUATION)
                 continue;
             //sign of empty entry
             if (tempEntry[0] == 0)
@@ -213,18 +677,34 @@ bool MyFileSystem::CheckDuplicateName(Entry *&entry)
 
 std::vector<unsigned int> MyFileSystem::GetClustersChain(unsigned int startingCluster)
 {
+    //FAT is read in windows, a window grows while the chain runs past its end
+    std::vector<unsigned int> window;
+    unsigned int windowStart = 0;
+    unsigned int windowSize = FAT_WINDOW_MIN;
+    auto readFAT = [&](unsigned int cluster)
+    {
+        if (cluster < windowStart || cluster >= windowStart + window.size())
+        {
+            if (cluster == windowStart + window.size())
+                windowSize = std::min(windowSize * 2, (unsigned int)FAT_WINDOW_MAX);
+            else windowSize = FAT_WINDOW_MIN;
+
+            windowStart = cluster;
+            window.assign(std::min(windowSize, FINAL_CLUSTER + 1 - cluster), 0);
+            ReadAt(sectorsBeforeFat * bytesPerSector + cluster * fatEntrySize, (char*)&window[0], window.size() * fatEntrySize);
+        }
+        return window[cluster - windowStart];
+    };
+
     std::vector<unsigned int> result;
     result.push_back(startingCluster);
-    f.seekg(sectorsBeforeFat * bytesPerSector + startingCluster * fatEntrySize, f.beg);
-    unsigned int nextCluster = 0;
-    f.read((char*)&nextCluster, fatEntrySize);
+    unsigned int nextCluster = readFAT(startingCluster);
     if (nextCluster == 0)
         return {};
-    while (nextCluster != MY_EOF)
+    while (nextCluster != MY_EOF && nextCluster <= FINAL_CLUSTER)
     {
         result.push_back(nextCluster);
-        f.seekg(sectorsBeforeFat * bytesPerSector + nextCluster * fatEntrySize, f.beg);
-        f.read((char*)&nextCluster, fatEntrySize);
+        nextCluster = readFAT(nextCluster);
     }
     return result;
 }
@@ -232,567 +712,3335 @@ std::vector<unsigned int> MyFileSystem::GetClustersChain(unsigned int startingCl
 std::vector<unsigned int> MyFileSystem::GetFreeClusters(unsigned int n)
 {
     std::vector<unsigned int> result;
-    //cluster for actual file's data starts from 3
-    unsigned int cluster = STARTING_CLUSTER + 1;
-    f.seekp(sectorsBeforeFat * bytesPerSector + cluster * fatEntrySize, f.beg);
+    if (n > fsInfo.freeClusters)
+    {
+        //deleted files waiting for the reclaimer go first, then the oldest restorable ones
+        ReclaimClusters();
+        if (n > fsInfo.freeClusters && mounted)
+            PurgeDeletedFiles(n);
+        if (n > fsInfo.freeClusters)
+            return result;
+    }
+
+    //read the FAT a sector at a time
+    std::vector<unsigned int> fatSector(bytesPerSector / fatEntrySize);
+    if (logMode)
+    {
+        //append at the log head, wrapping around to the start of data region once
+        //segments being cleaned are skipped so their live data does not move back into them
+        unsigned int start = std::max(fsInfo.logHead, (unsigned int)STARTING_CLUSTER + 1);
+        if (start > FINAL_CLUSTER)
+            start = STARTING_CLUSTER + 1;
+        unsigned int cluster = start;
+        bool load = true;
+        do
+        {
+            unsigned int index = cluster % fatSector.size();
+            if (index == 0 || load)
+                ReadAt(sectorsBeforeFat * bytesPerSector + (cluster - index) * fatEntrySize, (char*)&fatSector[0], bytesPerSector);
+            load = false;
+            if (fatSector[index] == FREE && (cleaningSegments.empty() || !cleaningSegments[cluster / LOG_SEGMENT]))
+            {
+                n--;
+                result.push_back(cluster);
+            }
+            if (++cluster > FINAL_CLUSTER)
+            {
+                cluster = STARTING_CLUSTER + 1;
+                load = true;
+            }
+        } while (n && cluster != start);
+        fsInfo.logHead = cluster;
+        if (n)
+            return {};
+        return result;
+    }
+
+    //cluster for actual file's data starts from 3, clusters before the hint are in use
+    unsigned int cluster = std::max(fsInfo.nextFreeCluster, (unsigned int)STARTING_CLUSTER + 1);
+    bool first = true;
     while (n && cluster <= FINAL_CLUSTER)
     {
-        unsigned int nextCluster = 0;
-        f.read((char*)&nextCluster, fatEntrySize);
+        unsigned int index = cluster % fatSector.size();
+        if (index == 0 || first)
+            ReadAt(sectorsBeforeFat * bytesPerSector + (cluster - index) * fatEntrySize, (char*)&fatSector[0], bytesPerSector);
+        first = false;
+        unsigned int nextCluster = fatSector[index];
         if (nextCluster == 0)
         {
+            if (result.empty())
+                fsInfo.nextFreeCluster = cluster;
             n--;
             result.push_back(cluster);
         }
         cluster++;
     }
+    if (result.empty())
+        fsInfo.nextFreeCluster = cluster;
     if (n)
         return {};
     return result;
 }
 
-void MyFileSystem::WriteClustersToFAT(const std::vector<unsigned int>& clusters)
+void MyFileSystem::RebuildFSInfo()
 {
-    int i = 0;
-    while (i < clusters.size() - 1)
+    //generation saved by the last backup is kept, changes after it are stamped in entries
+    unsigned int generation = fsInfo.signature == FSINFO_SIGNATURE ? fsInfo.generation : 0;
+    fsInfo = FSInfo();
+    fsInfo.generation = generation;
+    fsInfo.signature = FSINFO_SIGNATURE;
+
+    std::vector<char> fat = ReadBlock(sectorsBeforeFat * bytesPerSector, (FINAL_CLUSTER + 1) * fatEntrySize);
+    const unsigned int *fatEntries = (const unsigned int*)&fat[0];
+    fsInfo.nextFreeCluster = FINAL_CLUSTER + 1;
+    for (unsigned int cluster = FINAL_CLUSTER; cluster > STARTING_CLUSTER; cluster--)
     {
-        unsigned int offset = sectorsBeforeFat * bytesPerSector + clusters[i] * fatEntrySize;
-        f.seekp(offset, f.beg);
-        f.write((char*)&clusters[i + 1], fatEntrySize);
-        i++;
+        if (fatEntries[cluster] == FREE)
+        {
+            fsInfo.freeClusters++;
+            fsInfo.nextFreeCluster = cluster;
+        }
     }
-    unsigned int data = MY_EOF;
-    unsigned int offset = sectorsBeforeFat * bytesPerSector + clusters[i] * fatEntrySize;
-    f.seekp(offset);
-    f.write((char*)&data, fatEntrySize);
-    f.flush();
-}
 
-bool MyFileSystem::WriteFileEntry(Entry *&entry)
-{
-    std::vector<unsigned int> rdetClusters = GetClustersChain(STARTING_CLUSTER);
-    for (unsigned int cluster : rdetClusters)
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+    fsInfo.firstFreeSlot = rdet.size() * bytesPerSector * sectorsPerCluster;
+    bool slotFound = false, stampFound = false;
+    for (size_t c = 0; c < rdet.size(); c++)
     {
-        unsigned int sectorOffset = sectorsBeforeFat + fatSize + sectorsPerCluster * (cluster - STARTING_CLUSTER);
-        unsigned int bytesOffset = sectorOffset * bytesPerSector;
-        unsigned int limitOffset = bytesOffset + bytesPerSector * sectorsPerCluster;  //start of next cluster
-        for (; bytesOffset < limitOffset; bytesOffset += sizeof(Entry))
+        for (size_t slot = 0; slot < rdet[c].size(); slot += sizeof(Entry))
         {
-            std::vector<char> tempEntry = ReadBlock(bytesOffset, sizeof(Entry));
-            if (tempEntry[0] == 0 || (tempEntry[0] == -27 && tempEntry[ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH] == 0))
+            Entry *e = (Entry*)&rdet[c][slot];
+            if (e->name[0] != 0 && e->name[0] != ENTRY_CONTINUATION)
+                fsInfo.generation = std::max(fsInfo.generation, e->generation);
+            if (e->name[0] == -27 && e->reserved[0] != 0)
             {
-                f.seekp(bytesOffset, f.beg);
-                f.write((char*)entry, sizeof(Entry));
-                f.flush();
-                return true;
+                //latest stamp is the one less than half the stamp range ahead of the others, stamps wrap
+                unsigned int ahead = (e->GetDeleteStamp() - fsInfo.deleteStamp) & DELETE_STAMP_MASK;
+                if (!stampFound || (ahead != 0 && ahead <= DELETE_STAMP_MASK / 2))
+                    fsInfo.deleteStamp = e->GetDeleteStamp();
+                stampFound = true;
+            }
+            else if (!slotFound && (e->name[0] == 0 || (e->name[0] == -27 && e->reserved[0] == 0)))
+            {
+                fsInfo.firstFreeSlot = c * rdet[c].size() + slot;
+                slotFound = true;
             }
+            if (e->name[0] == 0)
+                return;
         }
     }
-    
-    //if out of space, append another cluster for RDET
-    std::vector<unsigned int> newFreeCluster = GetFreeClusters(1); 
-    if (newFreeCluster.empty())
-        return false;
-
-    //write to FAT new cluster of RDET
-    unsigned int offset = sectorsBeforeFat * bytesPerSector + rdetClusters[rdetClusters.size() - 1] * fatEntrySize;
-    f.seekp(offset, f.beg);
-    f.write((char*)&newFreeCluster[0], fatEntrySize);
-    offset = sectorsBeforeFat * bytesPerSector + newFreeCluster[0] * fatEntrySize;
-    f.seekp(offset, f.beg);
-    unsigned int eof = MY_EOF;
-    f.write((char*)&eof, fatEntrySize);
-
-    //write entry to new cluster
-    unsigned int sectorOffset = sectorsBeforeFat + fatSize + sectorsPerCluster * (newFreeCluster[0] - STARTING_CLUSTER);
-    unsigned int bytesOffset = sectorOffset * bytesPerSector;
-    f.seekp(bytesOffset, f.beg);
-    f.write((char*)entry, sizeof(Entry));
-    f.flush();
-    return true;
 }
 
-void MyFileSystem::WriteFileContent(const std::string& data, const std::vector<unsigned int>& clusters)
+MyFileSystem::VolumeCheck MyFileSystem::CheckVolume()
 {
-    int i = 0;
+    VolumeCheck result;
     const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
-    for (unsigned int cluster : clusters)
-    {
-        unsigned int sectorOffset = sectorsBeforeFat + fatSize + (cluster - STARTING_CLUSTER) * sectorsPerCluster;
-        unsigned int bytesOffset = sectorOffset * bytesPerSector;
-        f.seekp(bytesOffset, f.beg);
-        size_t size = ((size_t)clusterSize < data.size() - i) ? clusterSize : data.size() - i;
-        f.write(&data[i], size);
-        i += clusterSize;
-    }
-    f.flush();
-}
+    std::vector<char> fatData = ReadBlock(sectorsBeforeFat * bytesPerSector, (FINAL_CLUSTER + 1) * fatEntrySize);
+    const unsigned int *fat = (const unsigned int*)&fatData[0];
+    std::vector<unsigned int> owners(FINAL_CLUSTER + 1, 0);
 
-std::string MyFileSystem::ReadFileContent(unsigned int fileSize, const std::vector<unsigned int>& clusters)
-{
-    std::string data(fileSize, 0);
-    int i = 0;
-    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
-    for (unsigned int cluster : clusters)
+    //a chain is valid if it ends with EOF, it stops at a loop or a value that is not a cluster
+    auto walkChain = [&](unsigned int start, std::vector<unsigned int>& chain)
     {
-        unsigned int sectorOffset = sectorsBeforeFat + fatSize + (cluster - STARTING_CLUSTER) * sectorsPerCluster;
-        unsigned int bytesOffset = sectorOffset * bytesPerSector;
-        f.seekg(bytesOffset, f.beg);
-        size_t size = ((size_t)clusterSize < data.size() - i) ? clusterSize : data.size() - i;
-        f.read(&data[i], size);
-        i += clusterSize;
-    }
-    return data;
-}
-
-void MyFileSystem::ImportFile(const std::string& inputPath, bool hasPassword)
-{
-    std::ifstream fin(inputPath, std::ios::binary | std::ios::in);
-    if (!fin)
+        std::set<unsigned int> visited;
+        unsigned int cluster = start;
+        while (true)
+        {
+            if (cluster < STARTING_CLUSTER || cluster > FINAL_CLUSTER || fat[cluster] == FREE || fat[cluster] == MAPPED_CLUSTER || !visited.insert(cluster).second)
+                return false;
+            chain.push_back(cluster);
+            if (fat[cluster] == MY_EOF)
+                return true;
+            cluster = fat[cluster];
+        }
+    };
+    auto own = [&](const std::vector<unsigned int>& clusters)
     {
-        std::cout << "Path does not exist\n";
-        return;
-    }
-
+        for (unsigned int cluster : clusters)
+            owners[cluster]++;
+    };
+    auto ownTable = [&](unsigned int start)
+    {
+        std::vector<unsigned int> chain;
+        if (start != 0)
+        {
+            walkChain(start, chain);
+            own(chain);
+        }
+    };
+
+    std::vector<unsigned int> rdetClusters;
+    walkChain(STARTING_CLUSTER, rdetClusters);
+    own(rdetClusters);
+    ownTable(shareTableCluster);
+    ownTable(checksumTableCluster);
+
+    //live files and restorable deleted files own their clusters
+    for (unsigned int rdetCluster : rdetClusters)
+    {
+        std::vector<char> rdet = ReadBlock(GetClusterOffset(rdetCluster), clusterSize);
+        size_t coveredUntil = 0;
+        for (size_t slot = 0; slot < rdet.size(); slot += sizeof(Entry))
+        {
+            Entry *e = (Entry*)&rdet[slot];
+            //continuation slots written by an entry that never made it
+            if (e->name[0] == ENTRY_CONTINUATION && slot >= coveredUntil)
+                result.orphanSlots.push_back(GetClusterOffset(rdetCluster) + slot);
+            if (e->name[0] == 0 || e->name[0] == ENTRY_CONTINUATION || (e->name[0] == -27 && e->reserved[0] == 0))
+                continue;
+            coveredUntil = slot + (e->extraSlots + 1) * sizeof(Entry);
+            if (e->flags & ENTRY_INLINE)
+                continue;
+
+            unsigned int n = (e->fileSize + clusterSize - 1) / clusterSize;
+            if (n == 0)
+                n++;
+            std::vector<unsigned int> clusters;
+            bool valid = true;
+            if (e->flags & ENTRY_MAPPED)
+            {
+                std::vector<unsigned int> mapClusters;
+                valid = walkChain(e->mapCluster, mapClusters) && mapClusters.size() * clusterSize >= n * sizeof(unsigned int);
+                own(mapClusters);
+                if (valid)
+                {
+                    std::string raw = ReadFileContent(n * sizeof(unsigned int), mapClusters);
+                    for (unsigned int i = 0; i < n; i++)
+                    {
+                        unsigned int cluster = ((const unsigned int*)&raw[0])[i];
+                        if (cluster != HOLE)
+                            clusters.push_back(cluster);
+                    }
+                }
+            }
+            else if (e->flags & ENTRY_EXTENTS)
+            {
+                unsigned int offset = GetClusterOffset(rdetCluster) + slot;
+                unsigned int count = 0;
+                for (const std::pair<unsigned int, unsigned int>& extent : ReadExtents(e, offset))
+                {
+                    for (unsigned int i = 0; i < extent.second; i++)
+                        clusters.push_back(extent.first + i);
+                    count += extent.second;
+                }
+                valid = count == n;
+            }
+            else valid = walkChain(e->startingCluster, clusters) && clusters.size() == n;
+
+            //clusters outside chains must be marked as owned elsewhere, a chain being converted may still link them
+            if (e->flags & (ENTRY_MAPPED | ENTRY_EXTENTS))
+            {
+                for (unsigned int cluster : clusters)
+                {
+                    if (cluster < STARTING_CLUSTER || cluster > FINAL_CLUSTER || fat[cluster] == FREE)
+                        valid = false;
+                    else if (fat[cluster] != MAPPED_CLUSTER)
+                        result.unmarked.push_back(cluster);
+                }
+                clusters.erase(std::remove_if(clusters.begin(), clusters.end(), [](unsigned int cluster)
+                {
+                    return cluster < STARTING_CLUSTER || cluster > FINAL_CLUSTER;
+                }), clusters.end());
+            }
+            own(clusters);
+            if (!valid)
+                result.badEntries++;
+        }
+    }
+
+    bool hasShared = LoadShareCounts();
+    unsigned int freeClusters = 0;
+    for (unsigned int cluster = STARTING_CLUSTER + 1; cluster <= FINAL_CLUSTER; cluster++)
+    {
+        unsigned int allowed = 1 + (hasShared ? shareCounts[cluster] : 0);
+        if (fat[cluster] == FREE)
+            freeClusters++;
+        else if (owners[cluster] == 0)
+            result.leaked.push_back(cluster);
+        else if (owners[cluster] != allowed)
+            result.miscounted.push_back({cluster, owners[cluster]});
+        if (owners[cluster] > allowed)
+            result.crossLinked++;
+    }
+    result.freeSpaceMismatch = freeClusters != fsInfo.freeClusters;
+    return result;
+}
+
+void MyFileSystem::RepairVolume()
+{
+    VolumeCheck check = CheckVolume();
+
+    //a share count counts files other than the first owner, leaked clusters have none
+    if (check.miscounted.empty() ? LoadShareCounts() : LoadShareCounts(true))
+    {
+        std::vector<unsigned int> changed;
+        for (unsigned int cluster : check.leaked)
+        {
+            if (shareCounts[cluster] != 0)
+            {
+                shareCounts[cluster] = 0;
+                changed.push_back(cluster);
+            }
+        }
+        for (const std::pair<unsigned int, unsigned int>& shared : check.miscounted)
+        {
+            shareCounts[shared.first] = std::min<unsigned int>(shared.second - 1, MAX_SHARE_COUNT);
+            changed.push_back(shared.first);
+        }
+        WriteShareCounts(changed);
+    }
+
+    for (unsigned int offset : check.orphanSlots)
+    {
+        ClearSlots(offset, 1);
+        ReleaseSlot(offset);
+    }
+    MarkClustersInFAT(check.unmarked, MAPPED_CLUSTER);
+    FreeClusters(check.leaked);
+    recoveredClusters = check.leaked.size();
+    if (recoveredClusters)
+        std::cout << "Freed " << recoveredClusters << " clusters not owned by any file\n";
+    if (!check.miscounted.empty())
+        std::cout << "Fixed share count of " << check.miscounted.size() << " clusters\n";
+    if (check.badEntries)
+        std::cout << check.badEntries << " files do not match FAT!\n";
+}
+
+void MyFileSystem::TakeFreeClusters(const std::vector<unsigned int>& clusters)
+{
+    unsigned int value;
+    for (unsigned int cluster : clusters)
+    {
+        ReadAt(sectorsBeforeFat * bytesPerSector + cluster * fatEntrySize, (char*)&value, fatEntrySize);
+        if (value == FREE && fsInfo.freeClusters)
+            fsInfo.freeClusters--;
+    }
+}
+
+void MyFileSystem::ReleaseSlot(unsigned int offset)
+{
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    unsigned int cluster = (offset - GetClusterOffset(STARTING_CLUSTER)) / clusterSize + STARTING_CLUSTER;
+    std::vector<unsigned int> rdetClusters = GetClustersChain(STARTING_CLUSTER);
+    for (size_t i = 0; i < rdetClusters.size(); i++)
+    {
+        if (rdetClusters[i] == cluster)
+        {
+            fsInfo.firstFreeSlot = std::min(fsInfo.firstFreeSlot, (unsigned int)(i * clusterSize + (offset - GetClusterOffset(cluster))));
+            return;
+        }
+    }
+}
+
+void MyFileSystem::WriteClustersToFAT(const std::vector<unsigned int>& clusters)
+{
+    TakeFreeClusters(clusters);
+    int i = 0;
+    while (i < clusters.size() - 1)
+    {
+        unsigned int offset = sectorsBeforeFat * bytesPerSector + clusters[i] * fatEntrySize;
+        WriteAt(offset, (char*)&clusters[i + 1], fatEntrySize);
+        i++;
+    }
+    unsigned int data = MY_EOF;
+    unsigned int offset = sectorsBeforeFat * bytesPerSector + clusters[i] * fatEntrySize;
+    WriteAt(offset, (char*)&data, fatEntrySize);
+    Flush();
+}
+
+void MyFileSystem::MarkClustersInFAT(const std::vector<unsigned int>& clusters, unsigned int value)
+{
+    TakeFreeClusters(clusters);
+    for (unsigned int cluster : clusters)
+    {
+        unsigned int offset = sectorsBeforeFat * bytesPerSector + cluster * fatEntrySize;
+        WriteAt(offset, (char*)&value, fatEntrySize);
+    }
+    Flush();
+}
+
+void MyFileSystem::FreeClusters(const std::vector<unsigned int>& clusters)
+{
+    //clusters still used by a clone stay allocated
+    std::vector<unsigned int> freed;
+    std::vector<unsigned int> dereferenced;
+    bool hasShared = LoadShareCounts();
+    for (unsigned int cluster : clusters)
+    {
+        if (hasShared && shareCounts[cluster] != 0)
+        {
+            shareCounts[cluster]--;
+            dereferenced.push_back(cluster);
+        }
+        else freed.push_back(cluster);
+    }
+    WriteShareCounts(dereferenced);
+
+    //freed clusters may be reused by RDET, which is not checksummed
+    if (LoadChecksums())
+    {
+        for (unsigned int cluster : freed)
+            checksums[cluster] = NO_CHECKSUM;
+        WriteChecksums(freed);
+    }
+
+    //clear consecutive FAT entries with one write
+    std::sort(freed.begin(), freed.end());
+    size_t i = 0;
+    while (i < freed.size())
+    {
+        size_t j = i + 1;
+        while (j < freed.size() && freed[j] == freed[j - 1] + 1)
+            j++;
+
+        unsigned int fatOffset = sectorsBeforeFat * bytesPerSector + freed[i] * fatEntrySize; //in bytes
+        std::vector<char> empty((j - i) * fatEntrySize, 0);
+        WriteAt(fatOffset, &empty[0], empty.size());
+        i = j;
+    }
+    Flush();
+    fsInfo.freeClusters += freed.size();
+    if (!freed.empty())
+        fsInfo.nextFreeCluster = std::min(fsInfo.nextFreeCluster, freed[0]);
+
+    if (punchHoles)
+        PunchHoles(freed);
+}
+
+void MyFileSystem::QueueReclaim(Entry *&entry, unsigned int offset)
+{
+    if (entry->flags & ENTRY_INLINE)
+        return;
+    if (entry->flags & ENTRY_EXTENTS)
+    {
+        std::vector<unsigned int> clusters = GetFileClusters(entry, offset);
+        reclaimClusters.insert(reclaimClusters.end(), clusters.begin(), clusters.end());
+    }
+    else reclaimEntries.push_back(*entry);
+    reclaimWake.notify_one();
+}
+
+void MyFileSystem::ReclaimClusters()
+{
+    if (reclaimEntries.empty() && reclaimClusters.empty())
+        return;
+
+    //queued clusters are still allocated in FAT, a crash before this leaves them to RepairVolume
+    std::vector<unsigned int> clusters;
+    clusters.swap(reclaimClusters);
+    std::vector<Entry> entries;
+    entries.swap(reclaimEntries);
+    for (Entry& e : entries)
+    {
+        Entry *pE = &e;
+        std::vector<unsigned int> allocated = GetAllocatedClusters(pE, 0);
+        clusters.insert(clusters.end(), allocated.begin(), allocated.end());
+    }
+    FreeClusters(clusters);
+}
+
+void MyFileSystem::RunReclaimer()
+{
+    std::unique_lock<std::mutex> lock(volumeMutex);
+    while (!reclaimStop)
+    {
+        reclaimWake.wait(lock, [this] { return reclaimStop || !reclaimEntries.empty() || !reclaimClusters.empty(); });
+        //deletes that follow soon join the batch, operations run while this waits
+        reclaimWake.wait_for(lock, std::chrono::milliseconds(RECLAIM_DELAY), [this] { return reclaimStop; });
+        ReclaimClusters();
+    }
+}
+
+unsigned int MyFileSystem::PurgeDeletedFiles(unsigned int n)
+{
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+
+    //restorable deleted files, oldest first, by how many deletes ago they were made so wrapped stamps keep their order
+    std::vector<std::pair<unsigned int, std::pair<size_t, size_t>>> deleted;
+    bool end = false;
+    for (size_t c = 0; c < rdet.size() && !end; c++)
+    {
+        for (size_t slot = 0; slot < rdet[c].size(); slot += sizeof(Entry))
+        {
+            Entry *e = (Entry*)&rdet[c][slot];
+            if (e->name[0] == 0)
+            {
+                end = true;
+                break;
+            }
+            if (e->name[0] == -27 && e->reserved[0] != 0)
+                deleted.push_back({ (fsInfo.deleteStamp - e->GetDeleteStamp()) & DELETE_STAMP_MASK, { c, slot } });
+        }
+    }
+    std::sort(deleted.rbegin(), deleted.rend());
+
+    //purge in batches, a batch may free less than it owns when clusters are shared with clones
+    unsigned int purged = 0;
+    size_t next = 0;
+    while (n > fsInfo.freeClusters && next < deleted.size())
+    {
+        std::vector<bool> changed(rdet.size(), false);
+        std::vector<unsigned int> freedClusters;
+        while (next < deleted.size() && fsInfo.freeClusters + freedClusters.size() < n)
+        {
+            size_t c = deleted[next].second.first;
+            size_t slot = deleted[next].second.second;
+            next++;
+            Entry *e = (Entry*)&rdet[c][slot];
+            std::vector<unsigned int> clusters = GetAllocatedClusters(e, GetClusterOffset(rdetClusters[c]) + slot);
+            freedClusters.insert(freedClusters.end(), clusters.begin(), clusters.end());
+            for (unsigned int i = 1; i <= e->extraSlots; i++)
+            {
+                std::fill(&rdet[c][slot + i * sizeof(Entry)], &rdet[c][slot + (i + 1) * sizeof(Entry)], 0);
+                rdet[c][slot + i * sizeof(Entry)] = (char)0xE5;
+            }
+            e->reserved[0] = 0;
+            e->SetDeleteStamp(0);
+            fsInfo.firstFreeSlot = std::min(fsInfo.firstFreeSlot, (unsigned int)(c * rdet[c].size() + slot));
+            changed[c] = true;
+            purged++;
+        }
+
+        //commit entries first so no entry points to freed clusters
+        for (size_t c = 0; c < rdet.size(); c++)
+        {
+            if (changed[c])
+                WriteAt(GetClusterOffset(rdetClusters[c]), &rdet[c][0], rdet[c].size());
+        }
+        Flush();
+        indexValid = false;
+        FreeClusters(freedClusters);
+    }
+    if (purged)
+        std::cout << "Purged " << purged << " oldest restorable deleted files to free space\n";
+    return purged;
+}
+
+bool MyFileSystem::LoadShareCounts(bool create)
+{
+    if (!shareCounts.empty())
+        return true;
+    const unsigned int tableSize = FINAL_CLUSTER + 1;
+    if (shareTableCluster != 0)
+    {
+        shareTableClusters = GetClustersChain(shareTableCluster);
+        std::string table = ReadFileContent(tableSize, shareTableClusters);
+        shareCounts.assign(table.begin(), table.end());
+        return true;
+    }
+    if (!create)
+        return false;
+
+    //create the table on first clone
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    std::vector<unsigned int> tableClusters = GetFreeClusters((tableSize + clusterSize - 1) / clusterSize);
+    if (tableClusters.empty())
+        return false;
+    WriteClustersToFAT(tableClusters);
+    WriteFileContent(std::string(tableSize, 0), tableClusters);
+
+    shareTableCluster = tableClusters[0];
+    shareTableClusters = tableClusters;
+    shareCounts.assign(tableSize, 0);
+    WriteAt(SHARE_TABLE_OFFSET, (char*)&shareTableCluster, 4);
+    Flush();
+    return true;
+}
+
+void MyFileSystem::WriteShareCounts(const std::vector<unsigned int>& clusters)
+{
+    if (clusters.empty())
+        return;
+
+    //rewrite each touched cluster of the table once
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    std::vector<unsigned int> tableIndexes;
+    for (unsigned int cluster : clusters)
+        tableIndexes.push_back(cluster / clusterSize);
+    std::sort(tableIndexes.begin(), tableIndexes.end());
+    tableIndexes.erase(std::unique(tableIndexes.begin(), tableIndexes.end()), tableIndexes.end());
+
+    for (unsigned int index : tableIndexes)
+    {
+        unsigned int begin = index * clusterSize;
+        unsigned int size = std::min(clusterSize, (unsigned int)shareCounts.size() - begin);
+        std::string data((char*)&shareCounts[begin], size);
+        WriteFileContent(data, { shareTableClusters[index] });
+    }
+}
+
+bool MyFileSystem::PunchHoles(std::vector<unsigned int> clusters, size_t *punched)
+{
+    if (punched)
+        *punched = 0;
+#ifdef __linux__
+    if (fd == -1)
+    {
+        errno = EOPNOTSUPP;
+        return false;
+    }
+    if (clusters.empty())
+        return true;
+
+    //pending writes must reach the host file before its blocks are released
+    Flush();
+
+    //coalesce clusters into runs so each run costs one call
+    std::sort(clusters.begin(), clusters.end());
+    const off_t clusterSize = bytesPerSector * sectorsPerCluster;
+    const off_t dataOffset = (off_t)(sectorsBeforeFat + fatSize) * bytesPerSector;
+    size_t i = 0;
+    while (i < clusters.size())
+    {
+        size_t j = i + 1;
+        while (j < clusters.size() && clusters[j] == clusters[j - 1] + 1)
+            j++;
+
+        off_t offset = dataOffset + (off_t)(clusters[i] - STARTING_CLUSTER) * clusterSize;
+        off_t length = (off_t)(j - i) * clusterSize;
+        for (const HostRun& run : MapHostRange(offset, length))
+        {
+            if (HostFd(run.file) == -1)
+                errno = EBADF;
+            else if (fallocate(HostFd(run.file), FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, run.offset, run.size) == 0)
+                continue;
+            if (punched)
+                *punched = i + run.position / clusterSize;
+            return false;
+        }
+        i = j;
+    }
+    if (punched)
+        *punched = clusters.size();
+    return true;
+#else
+    errno = EOPNOTSUPP;
+    return false;
+#endif
+}
+
+bool MyFileSystem::WriteFileEntry(Entry *&entry, const std::string& inlineData, unsigned int *entryOffset)
+{
+    //entry is followed by continuation slots in the same cluster
+    std::string record((char*)entry, (char*)entry + sizeof(Entry));
+    for (size_t i = 0; i < inlineData.size(); i += INLINE_SLOT_SIZE)
+    {
+        std::string slot(sizeof(Entry), 0);
+        slot[0] = ENTRY_CONTINUATION;
+        inlineData.copy(&slot[1], INLINE_SLOT_SIZE, i);
+        record += slot;
+    }
+    const unsigned int slotsNeeded = record.size() / sizeof(Entry);
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+
+    //empty slots mark the end of RDET, the ones passed over become deleted ones before an entry is written after them
+    std::vector<unsigned int> emptySlots;
+    auto clearEmptySlots = [&](size_t count)
+    {
+        for (size_t i = 0, j; i < count; i = j)
+        {
+            for (j = i + 1; j < count && emptySlots[j] == emptySlots[j - 1] + sizeof(Entry); j++);
+            ClearSlots(emptySlots[i], j - i);
+        }
+    };
+
+    //search starts at the first slot that may be free
+    std::vector<unsigned int> rdetClusters = GetClustersChain(STARTING_CLUSTER);
+    unsigned int firstFree = rdetClusters.size() * clusterSize;
+    for (size_t c = fsInfo.firstFreeSlot / clusterSize; c < rdetClusters.size(); c++)
+    {
+        unsigned int sectorOffset = sectorsBeforeFat + fatSize + sectorsPerCluster * (rdetClusters[c] - STARTING_CLUSTER);
+        unsigned int bytesOffset = sectorOffset * bytesPerSector;
+        unsigned int limitOffset = bytesOffset + clusterSize;  //start of next cluster
+        if (c == fsInfo.firstFreeSlot / clusterSize)
+            bytesOffset += fsInfo.firstFreeSlot % clusterSize;
+        unsigned int runOffset = bytesOffset;
+        unsigned int runLength = 0;
+        size_t emptyBeforeRun = 0;
+        for (; bytesOffset < limitOffset; bytesOffset += sizeof(Entry))
+        {
+            std::vector<char> tempEntry = ReadBlock(bytesOffset, sizeof(Entry));
+            if (tempEntry[0] == 0 || (tempEntry[0] == -27 && tempEntry[ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH] == 0))
+            {
+                if (runLength++ == 0)
+                {
+                    runOffset = bytesOffset;
+                    emptyBeforeRun = emptySlots.size();
+                }
+                firstFree = std::min(firstFree, (unsigned int)(c * clusterSize + bytesOffset - (limitOffset - clusterSize)));
+                if (tempEntry[0] == 0)
+                    emptySlots.push_back(bytesOffset);
+            }
+            else runLength = 0;
+
+            if (runLength == slotsNeeded)
+            {
+                //slots the record itself takes are overwritten anyway
+                clearEmptySlots(emptyBeforeRun);
+
+                //continuation slots reach the volume before the entry that makes them part of a file
+                if (slotsNeeded > 1)
+                {
+                    WriteAt(runOffset + sizeof(Entry), &record[sizeof(Entry)], record.size() - sizeof(Entry));
+                    Flush();
+                }
+                WriteAt(runOffset, &record[0], sizeof(Entry));
+                Flush();
+                indexValid = false;
+                if (entryOffset)
+                    *entryOffset = runOffset;
+                unsigned int runPosition = c * clusterSize + runOffset - (limitOffset - clusterSize);
+                fsInfo.firstFreeSlot = firstFree == runPosition ? runPosition + record.size() : firstFree;
+                return true;
+            }
+        }
+    }
+    
+    //a file purged for space releases its slots as well, look for them again
+    if (fsInfo.freeClusters == 0)
+    {
+        ReclaimClusters();
+        if (fsInfo.freeClusters == 0 && mounted && PurgeDeletedFiles(1))
+            return WriteFileEntry(entry, inlineData, entryOffset);
+    }
+
+    //if out of space, append another cluster for RDET
+    std::vector<unsigned int> newFreeCluster = GetFreeClusters(1); 
+    if (newFreeCluster.empty())
+        return false;
+    clearEmptySlots(emptySlots.size());
+
+    //write entry to new cluster, the rest of it is cleared since it may hold old data
+    //it reaches the volume before the cluster is linked to RDET so a crash never exposes old data as entries
+    TakeFreeClusters(newFreeCluster);
+    unsigned int sectorOffset = sectorsBeforeFat + fatSize + sectorsPerCluster * (newFreeCluster[0] - STARTING_CLUSTER);
+    unsigned int bytesOffset = sectorOffset * bytesPerSector;
+    if (firstFree == rdetClusters.size() * clusterSize)
+        fsInfo.firstFreeSlot = firstFree + record.size();
+    else fsInfo.firstFreeSlot = firstFree;
+    record.resize(clusterSize, 0);
+    WriteAt(bytesOffset, &record[0], record.size());
+    unsigned int offset = sectorsBeforeFat * bytesPerSector + newFreeCluster[0] * fatEntrySize;
+    unsigned int eof = MY_EOF;
+    WriteAt(offset, (char*)&eof, fatEntrySize);
+    Flush();
+
+    //write to FAT new cluster of RDET
+    offset = sectorsBeforeFat * bytesPerSector + rdetClusters[rdetClusters.size() - 1] * fatEntrySize;
+    WriteAt(offset, (char*)&newFreeCluster[0], fatEntrySize);
+    Flush();
+    indexValid = false;
+    if (entryOffset)
+        *entryOffset = bytesOffset;
+    return true;
+}
+
+unsigned int MyFileSystem::WriteFileEntries(std::vector<Entry>& entries, const std::vector<std::string>& fileNames, const std::vector<std::string>& slotData)
+{
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    const unsigned int slotsPerCluster = clusterSize / sizeof(Entry);
+
+    //room for RDET to grow is made before RDET is read, purging a deleted file for it rewrites RDET
+    unsigned int slotsNeeded = 0;
+    for (const std::string& data : slotData)
+        slotsNeeded += 1 + (data.size() + INLINE_SLOT_SIZE - 1) / INLINE_SLOT_SIZE;
+    unsigned int spare = (slotsNeeded + slotsPerCluster - 1) / slotsPerCluster;
+    if (fsInfo.freeClusters < spare)
+        GetFreeClusters(spare);
+
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+    const std::vector<std::vector<char>> original = rdet;
+    const size_t existing = rdet.size();
+    std::vector<bool> changed(existing, false);
+    std::set<std::string> names;
+    for (const std::vector<char>& cluster : rdet)
+    {
+        for (size_t slot = 0; slot < cluster.size(); slot += sizeof(Entry))
+        {
+            const Entry *e = (const Entry*)&cluster[slot];
+            if (e->name[0] != 0 && e->name[0] != -27 && e->name[0] != ENTRY_CONTINUATION)
+                names.insert(std::string(e->name, e->name + ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH));
+        }
+    }
+
+    //entries are placed one after another from the first slot that may be free, new clusters are appended as needed
+    auto isFree = [&](size_t c, size_t slot)
+    {
+        return rdet[c][slot] == 0 || (rdet[c][slot] == -27 && rdet[c][slot + ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH] == 0);
+    };
+    std::vector<std::pair<size_t, size_t>> positions;
+    size_t c = fsInfo.firstFreeSlot / clusterSize;
+    size_t slot = fsInfo.firstFreeSlot % clusterSize;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const size_t count = 1 + (slotData[i].size() + INLINE_SLOT_SIZE - 1) / INLINE_SLOT_SIZE;
+        while (true)
+        {
+            if (c == rdet.size())
+            {
+                rdet.push_back(std::vector<char>(clusterSize, 0));
+                slot = 0;
+            }
+            size_t run = 0;
+            while (slot + (run + 1) * sizeof(Entry) <= clusterSize && run < count && isFree(c, slot + run * sizeof(Entry)))
+                run++;
+            if (run == count)
+                break;
+            if (slot + (run + 1) * sizeof(Entry) > clusterSize)
+            {
+                //empty slots mark the end of RDET, make them deleted ones since entries will be written after them
+                for (size_t k = slot; k < clusterSize; k += sizeof(Entry))
+                {
+                    if (rdet[c][k] == 0)
+                    {
+                        rdet[c][k] = (char)0xE5;
+                        if (c < existing)
+                            changed[c] = true;
+                    }
+                }
+                c++;
+                slot = 0;
+            }
+            else slot += (run + 1) * sizeof(Entry);
+        }
+
+        //name may be taken by a file in RDET or earlier in the batch
+        Entry& e = entries[i];
+        unsigned int number = 1;
+        while (names.count(std::string(e.name, e.name + ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH)))
+            e.SetName(fileNames[i], ++number, true);
+        names.insert(std::string(e.name, e.name + ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH));
+
+        memcpy(&rdet[c][slot], &e, sizeof(Entry));
+        for (size_t k = 1; k < count; k++)
+        {
+            char *continuation = &rdet[c][slot + k * sizeof(Entry)];
+            std::fill(continuation, continuation + sizeof(Entry), 0);
+            continuation[0] = ENTRY_CONTINUATION;
+            slotData[i].copy(continuation + 1, INLINE_SLOT_SIZE, (k - 1) * INLINE_SLOT_SIZE);
+        }
+        positions.push_back({ c, slot });
+        if (c < existing)
+            changed[c] = true;
+        slot += count * sizeof(Entry);
+    }
+
+    //entries in new clusters are written only if RDET can grow
+    unsigned int written = entries.size();
+    std::vector<unsigned int> newClusters;
+    if (rdet.size() > existing)
+    {
+        newClusters = GetFreeClusters(rdet.size() - existing);
+        if (newClusters.empty())
+        {
+            written = 0;
+            while (written < positions.size() && positions[written].first < existing)
+                written++;
+            rdet.resize(existing);
+        }
+    }
+
+    //continuation slots reach the volume before the entries that make them part of a file
+    std::vector<std::vector<char>> withoutEntries(rdet.begin(), rdet.begin() + existing);
+    for (const std::pair<size_t, size_t>& position : positions)
+    {
+        if (position.first < existing)
+            std::copy(&original[position.first][position.second], &original[position.first][position.second] + sizeof(Entry), &withoutEntries[position.first][position.second]);
+    }
+    for (size_t c = 0; c < existing; c++)
+    {
+        if (changed[c])
+            WriteAt(GetClusterOffset(rdetClusters[c]), &withoutEntries[c][0], clusterSize);
+    }
+
+    //new clusters are written and ended before they are linked to RDET
+    if (!newClusters.empty())
+    {
+        TakeFreeClusters(newClusters);
+        for (size_t i = 0; i < newClusters.size(); i++)
+        {
+            WriteAt(GetClusterOffset(newClusters[i]), &rdet[existing + i][0], clusterSize);
+            unsigned int next = i + 1 < newClusters.size() ? newClusters[i + 1] : MY_EOF;
+            WriteAt(sectorsBeforeFat * bytesPerSector + newClusters[i] * fatEntrySize, (char*)&next, fatEntrySize);
+        }
+    }
+    Flush();
+
+    for (size_t c = 0; c < existing; c++)
+    {
+        if (changed[c])
+            WriteAt(GetClusterOffset(rdetClusters[c]), &rdet[c][0], clusterSize);
+    }
+    if (!newClusters.empty())
+        WriteAt(sectorsBeforeFat * bytesPerSector + rdetClusters.back() * fatEntrySize, (char*)&newClusters[0], fatEntrySize);
+    Flush();
+    indexValid = false;
+
+    //first free slot after the batch
+    size_t first = fsInfo.firstFreeSlot / clusterSize * clusterSize;
+    fsInfo.firstFreeSlot = rdet.size() * clusterSize;
+    for (size_t position = first; position < rdet.size() * clusterSize; position += sizeof(Entry))
+    {
+        if (isFree(position / clusterSize, position % clusterSize))
+        {
+            fsInfo.firstFreeSlot = position;
+            break;
+        }
+    }
+    return written;
+}
+
+std::string MyFileSystem::ReadSlotData(unsigned int offset, unsigned int count)
+{
+    std::string data;
+    if (count == 0)
+        return data;
+
+    //read all slots at once
+    std::vector<char> slots = ReadBlock(offset + sizeof(Entry), count * sizeof(Entry));
+    for (unsigned int i = 0; i < count; i++)
+        data.append(&slots[i * sizeof(Entry) + 1], INLINE_SLOT_SIZE);
+    return data;
+}
+
+std::string MyFileSystem::ReadInlineData(Entry *&entry, unsigned int offset)
+{
+    std::string data = ReadSlotData(offset, entry->extraSlots);
+    data.resize(entry->fileSize);
+    return data;
+}
+
+void MyFileSystem::WriteInlineData(const std::string& data, unsigned int offset)
+{
+    for (size_t i = 0; i < data.size(); i += INLINE_SLOT_SIZE)
+    {
+        offset += sizeof(Entry);
+        WriteAt(offset + 1, &data[i], std::min((size_t)INLINE_SLOT_SIZE, data.size() - i));
+    }
+    Flush();
+}
+
+void MyFileSystem::ClearSlots(unsigned int offset, unsigned int count)
+{
+    std::string slots(count * sizeof(Entry), 0);
+    for (unsigned int i = 0; i < count; i++)
+        slots[i * sizeof(Entry)] = (char)0xE5;
+    WriteAt(offset, &slots[0], slots.size());
+    Flush();
+}
+
+void MyFileSystem::WriteFileContent(const std::string& data, const std::vector<unsigned int>& clusters)
+{
+    const size_t clusterSize = bytesPerSector * sectorsPerCluster;
+    const bool hasChecksums = LoadChecksums();
+    std::vector<unsigned int> written;
+    size_t k = 0;
+    while (k < clusters.size() && k * clusterSize < data.size())
+    {
+        //holes are not stored
+        if (clusters[k] == HOLE)
+        {
+            k++;
+            continue;
+        }
+
+        //consecutive clusters are written at once
+        //the last cluster is padded with zeros so its checksum covers what is on the volume
+        size_t j = k + 1;
+        while (j < clusters.size() && j * clusterSize < data.size() && clusters[j] == clusters[j - 1] + 1)
+            j++;
+        std::string run = data.substr(k * clusterSize, (j - k) * clusterSize);
+        run.resize((j - k) * clusterSize, 0);
+        WriteAt(GetClusterOffset(clusters[k]), &run[0], run.size());
+
+        if (hasChecksums)
+        {
+            for (size_t c = k; c < j; c++)
+            {
+                checksums[clusters[c]] = ComputeChecksum(&run[(c - k) * clusterSize]);
+                written.push_back(clusters[c]);
+            }
+        }
+        k = j;
+    }
+    WriteChecksums(written);
+    Flush();
+}
+
+std::string MyFileSystem::ReadFileContent(unsigned int fileSize, const std::vector<unsigned int>& clusters, bool *verified)
+{
+    return ReadFileContent(nullptr, fileSize, clusters, verified);
+}
+
+std::string MyFileSystem::ReadFileContent(std::vector<std::ifstream> *in, unsigned int fileSize, const std::vector<unsigned int>& clusters, bool *verified)
+{
+    if (verified)
+        *verified = true;
+    const size_t clusterSize = bytesPerSector * sectorsPerCluster;
+    const size_t clusterCount = std::min(clusters.size(), (fileSize + clusterSize - 1) / clusterSize);
+    //whole clusters are read so they can be checked against their checksums
+    std::string data(std::max((size_t)fileSize, clusterCount * clusterSize), 0);
+
+    //clusters before this index are already hinted to host
+    size_t prefetched = 0;
+    size_t readAhead = READ_AHEAD_MIN;
+    size_t k = 0;
+    while (k < clusterCount)
+    {
+        //keep hints a window ahead of the read position
+        if (prefetched < std::min(clusterCount, k + 2 * readAhead))
+        {
+            size_t end = std::min(clusterCount, k + 2 * readAhead);
+            PrefetchClusters(clusters, prefetched, end - prefetched);
+            prefetched = end;
+        }
+
+        //holes read as zeros without touching the volume
+        if (clusters[k] == HOLE)
+        {
+            k++;
+            continue;
+        }
+
+        //read consecutive clusters at once, at most one window
+        size_t j = k + 1;
+        while (j < clusterCount && j - k < readAhead && clusters[j] == clusters[j - 1] + 1)
+            j++;
+        size_t position = k * clusterSize;
+        size_t size = std::min((j - k) * clusterSize, data.size() - position);
+        if (in)
+            ReadHost(GetClusterOffset(clusters[k]), &data[position], size, in);
+        else ReadAt(GetClusterOffset(clusters[k]), &data[position], size);
+        if (!VerifyClusters(&data[position], clusters, k, j) && verified)
+            *verified = false;
+
+        //window grows while the next cluster is close behind, a far jump means access is random
+        if (j < clusterCount && clusters[j] != HOLE && (clusters[j] < clusters[j - 1] || clusters[j] - clusters[j - 1] > READ_AHEAD_MAX))
+            readAhead = READ_AHEAD_MIN;
+        else readAhead = std::min(readAhead * 2, (size_t)READ_AHEAD_MAX);
+        k = j;
+    }
+    data.resize(fileSize);
+    return data;
+}
+
+bool MyFileSystem::WriteStreamedContent(Entry *&entry, const std::function<bool(char*, size_t)>& read, std::vector<unsigned int>& clusters)
+{
+    //content is not in memory, so clusters are taken from entry's size
+    clusters = AllocateFileClusters(entry, "", true);
+    if (clusters.empty())
+        return true;
+
+    //content goes straight to its clusters a chunk at a time
+    const size_t clusterSize = bytesPerSector * sectorsPerCluster;
+    const size_t chunkClusters = INGEST_CHUNK / clusterSize;
+    std::string chunk;
+    for (size_t first = 0; first < clusters.size(); first += chunkClusters)
+    {
+        chunk.resize(std::min(chunkClusters * clusterSize, entry->fileSize - first * clusterSize));
+        if (!read(&chunk[0], chunk.size()))
+            return false;
+        WriteFileContent(chunk, std::vector<unsigned int>(clusters.begin() + first, clusters.begin() + std::min(first + chunkClusters, clusters.size())));
+    }
+    return true;
+}
+
+unsigned int MyFileSystem::ComputeChecksum(const char *cluster)
+{
+    unsigned int checksum = 0;
+    CryptoPP::CRC32C crc;
+    crc.CalculateDigest((byte*)&checksum, (const byte*)cluster, bytesPerSector * sectorsPerCluster);
+    //0 means not verified, a real 0 is stored as 1 and accepts both
+    return checksum == NO_CHECKSUM ? 1 : checksum;
+}
+
+bool MyFileSystem::VerifyClusters(const char *data, const std::vector<unsigned int>& clusters, size_t from, size_t to)
+{
+    if (!LoadChecksums())
+        return true;
+
+    const size_t clusterSize = bytesPerSector * sectorsPerCluster;
+    bool result = true;
+    for (size_t k = from; k < to; k++)
+    {
+        unsigned int expected = checksums[clusters[k]];
+        if (expected != NO_CHECKSUM && ComputeChecksum(data + (k - from) * clusterSize) != expected)
+        {
+            std::cout << "Checksum mismatch in cluster " << clusters[k] << "!\n";
+            result = false;
+        }
+    }
+    return result;
+}
+
+bool MyFileSystem::LoadChecksums(bool create)
+{
+    if (!checksums.empty())
+        return true;
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    const unsigned int tableSize = (FINAL_CLUSTER + 1) * sizeof(unsigned int);
+    if (checksumTableCluster != 0)
+    {
+        //the table is not checksummed, reading it verifies nothing and does not load it again
+        checksums.assign(FINAL_CLUSTER + 1, NO_CHECKSUM);
+        checksumTableClusters = GetClustersChain(checksumTableCluster);
+        std::string table = ReadFileContent(tableSize, checksumTableClusters);
+        memcpy(&checksums[0], &table[0], tableSize);
+        return true;
+    }
+    if (!create)
+        return false;
+
+    //volume made before checksums, build the table from what is stored now
+    std::vector<unsigned int> tableClusters = GetFreeClusters((tableSize + clusterSize - 1) / clusterSize);
+    if (tableClusters.empty())
+        return false;
+    WriteClustersToFAT(tableClusters);
+
+    std::vector<char> fat = ReadBlock(sectorsBeforeFat * bytesPerSector, (FINAL_CLUSTER + 1) * fatEntrySize);
+    const unsigned int *fatEntries = (const unsigned int*)&fat[0];
+    std::vector<unsigned int> rdetClusters = GetClustersChain(STARTING_CLUSTER);
+    std::set<unsigned int> skipped(rdetClusters.begin(), rdetClusters.end());
+    skipped.insert(tableClusters.begin(), tableClusters.end());
+    std::vector<unsigned int> dataClusters;
+    for (unsigned int cluster = STARTING_CLUSTER + 1; cluster <= FINAL_CLUSTER; cluster++)
+    {
+        if (fatEntries[cluster] != FREE && !skipped.count(cluster))
+            dataClusters.push_back(cluster);
+    }
+
+    std::vector<unsigned int> computed(FINAL_CLUSTER + 1, NO_CHECKSUM);
+    const size_t batch = READ_AHEAD_MAX;
+    for (size_t i = 0; i < dataClusters.size(); i += batch)
+    {
+        std::vector<unsigned int> part(dataClusters.begin() + i, dataClusters.begin() + std::min(i + batch, dataClusters.size()));
+        std::string data = ReadFileContent(part.size() * clusterSize, part);
+        for (size_t k = 0; k < part.size(); k++)
+            computed[part[k]] = ComputeChecksum(&data[k * clusterSize]);
+    }
+
+    checksumTableCluster = tableClusters[0];
+    checksumTableClusters = tableClusters;
+    checksums = computed;
+    std::vector<unsigned int> allClusters;
+    for (size_t i = 0; i < tableClusters.size(); i++)
+        allClusters.push_back(i * clusterSize / sizeof(unsigned int));
+    WriteChecksums(allClusters);
+    WriteAt(CHECKSUM_TABLE_OFFSET, (char*)&checksumTableCluster, 4);
+    Flush();
+    return true;
+}
+
+void MyFileSystem::WriteChecksums(const std::vector<unsigned int>& clusters)
+{
+    if (clusters.empty() || checksums.empty())
+        return;
+
+    //rewrite each touched cluster of the table once
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    const unsigned int perCluster = clusterSize / sizeof(unsigned int);
+    std::set<unsigned int> tableIndexes;
+    for (unsigned int cluster : clusters)
+        tableIndexes.insert(cluster / perCluster);
+
+    for (unsigned int index : tableIndexes)
+    {
+        unsigned int begin = index * perCluster;
+        unsigned int count = std::min(perCluster, (unsigned int)checksums.size() - begin);
+        WriteAt(GetClusterOffset(checksumTableClusters[index]), (char*)&checksums[begin], count * sizeof(unsigned int));
+    }
+}
+
+void MyFileSystem::PrefetchClusters(const std::vector<unsigned int>& clusters, size_t from, size_t count)
+{
+#ifdef __linux__
+    if (fd == -1)
+        return;
+
+    //one hint per run of consecutive clusters
+    const off_t clusterSize = bytesPerSector * sectorsPerCluster;
+    size_t end = from + count;
+    size_t k = from;
+    while (k < end)
+    {
+        if (clusters[k] == HOLE)
+        {
+            k++;
+            continue;
+        }
+        size_t j = k + 1;
+        while (j < end && clusters[j] == clusters[j - 1] + 1)
+            j++;
+        for (const HostRun& run : MapHostRange(GetClusterOffset(clusters[k]), (j - k) * clusterSize))
+            posix_fadvise(HostFd(run.file), run.offset, run.size, POSIX_FADV_WILLNEED);
+        k = j;
+    }
+#endif
+}
+
+bool MyFileSystem::IsZeroBlock(const char *data, size_t size)
+{
+    size_t i = 0;
+#if defined(__SSE2__) || defined(_M_X64)
+    //check 64 bytes per step with SSE2
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 64 <= size; i += 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(data + i + 16));
+        __m128i c = _mm_loadu_si128((const __m128i*)(data + i + 32));
+        __m128i d = _mm_loadu_si128((const __m128i*)(data + i + 48));
+        __m128i acc = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, zero)) != 0xFFFF)
+            return false;
+    }
+#endif
+    for (; i < size; i++)
+    {
+        if (data[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+std::vector<unsigned int> MyFileSystem::ReadClusterMap(Entry *&entry)
+{
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    unsigned int n = (entry->fileSize + clusterSize - 1) / clusterSize;
+    if (n == 0)
+        n++;
+
+    std::vector<unsigned int> mapClusters = GetClustersChain(entry->mapCluster);
+    std::string raw = ReadFileContent(n * sizeof(unsigned int), mapClusters);
+    std::vector<unsigned int> map(n, HOLE);
+    memcpy(&map[0], &raw[0], raw.size());
+    return map;
+}
+
+void MyFileSystem::WriteClusterMap(const std::vector<unsigned int>& map, const std::vector<unsigned int>& mapClusters)
+{
+    std::string raw((const char*)&map[0], (const char*)&map[0] + map.size() * sizeof(unsigned int));
+    WriteFileContent(raw, mapClusters);
+}
+
+std::string MyFileSystem::EncodeExtents(const std::vector<unsigned int>& clusters)
+{
+    std::string data;
+    size_t i = 0;
+    while (i < clusters.size())
+    {
+        size_t j = i + 1;
+        while (j < clusters.size() && clusters[j] == clusters[j - 1] + 1)
+            j++;
+        if (data.size() == MAX_EXTENTS * EXTENT_SIZE)
+            return "";
+
+        unsigned int extent[2] = { clusters[i], (unsigned int)(j - i) };
+        data.append((const char*)extent, EXTENT_SIZE);
+        i = j;
+    }
+    return data;
+}
+
+std::vector<std::pair<unsigned int, unsigned int>> MyFileSystem::ReadExtents(Entry *&entry, unsigned int offset)
+{
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    unsigned int n = (entry->fileSize + clusterSize - 1) / clusterSize;
+    if (n == 0)
+        n++;
+
+    //extents are packed across slots, the last one ends at file's last cluster
+    std::string data = ReadSlotData(offset, entry->extraSlots);
+
+    std::vector<std::pair<unsigned int, unsigned int>> extents;
+    for (size_t i = 0; n != 0 && i + EXTENT_SIZE <= data.size(); i += EXTENT_SIZE)
+    {
+        unsigned int extent[2];
+        memcpy(extent, &data[i], EXTENT_SIZE);
+        extent[1] = std::min(extent[1], n);
+        extents.push_back({ extent[0], extent[1] });
+        n -= extent[1];
+    }
+    return extents;
+}
+
+std::vector<unsigned int> MyFileSystem::GetFileClusters(Entry *&entry, unsigned int offset)
+{
+    if (entry->flags & ENTRY_INLINE)
+        return {};
+    if (entry->flags & ENTRY_MAPPED)
+        return ReadClusterMap(entry);
+    if (!(entry->flags & ENTRY_EXTENTS))
+        return GetClustersChain(entry->startingCluster);
+
+    std::vector<unsigned int> result;
+    for (const std::pair<unsigned int, unsigned int>& extent : ReadExtents(entry, offset))
+    {
+        for (unsigned int i = 0; i < extent.second; i++)
+            result.push_back(extent.first + i);
+    }
+    return result;
+}
+
+std::vector<unsigned int> MyFileSystem::GetAllocatedClusters(Entry *&entry, unsigned int offset)
+{
+    if (entry->flags & ENTRY_INLINE)
+        return {};
+    if (!(entry->flags & ENTRY_MAPPED))
+        return GetFileClusters(entry, offset);
+
+    std::vector<unsigned int> result = GetClustersChain(entry->mapCluster);
+    for (unsigned int cluster : ReadClusterMap(entry))
+    {
+        if (cluster != HOLE)
+            result.push_back(cluster);
+    }
+    return result;
+}
+
+bool MyFileSystem::ConvertToClusterMap(Entry *&entry, unsigned int offset)
+{
+    if (entry->flags & (ENTRY_MAPPED | ENTRY_INLINE))
+        return true;
+
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    std::vector<unsigned int> clusters = GetFileClusters(entry, offset);
+    std::vector<unsigned int> mapClusters = GetFreeClusters((clusters.size() * sizeof(unsigned int) + clusterSize - 1) / clusterSize);
+    if (mapClusters.empty())
+        return false;
+
+    WriteClustersToFAT(mapClusters);
+    WriteClusterMap(clusters, mapClusters);
+    Flush();
+
+    //entry switches to the map before old slots and FAT chain are touched,
+    //a crash in between leaves unused slots and clusters that repair marks as mapped
+    unsigned int extraSlots = entry->extraSlots;
+    bool hadExtents = entry->flags & ENTRY_EXTENTS;
+    entry->flags &= ~ENTRY_EXTENTS;
+    entry->flags |= ENTRY_MAPPED;
+    entry->mapCluster = mapClusters[0];
+    entry->startingCluster = 0;
+    WriteAt(offset, (char*)entry, sizeof(Entry));
+    Flush();
+
+    //cluster map replaces extents, a wrapped key moves to the first slot
+    if (hadExtents)
+    {
+        unsigned int kept = 0;
+        if (entry->flags & ENTRY_WRAPPED_KEY)
+        {
+            WriteInlineData(ReadKeySlot(entry, offset), offset);
+            Flush();
+            kept = 1;
+        }
+        entry->extraSlots = kept;
+        WriteAt(offset, (char*)entry, sizeof(Entry));
+        Flush();
+        ClearSlots(offset + (kept + 1) * sizeof(Entry), extraSlots - kept);
+        ReleaseSlot(offset + (kept + 1) * sizeof(Entry));
+    }
+    else MarkClustersInFAT(clusters, MAPPED_CLUSTER);
+    return true;
+}
+
+bool MyFileSystem::RelocateFile(Entry *&entry, unsigned int offset, const std::string& data, bool encrypted, std::vector<unsigned int>& oldClusters, std::string *extents)
+{
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    unsigned int n = (entry->fileSize + clusterSize - 1) / clusterSize;
+    if (n == 0)
+        n++;
+
+    //new clusters are taken and written before anything points to them,
+    //a crash before the caller writes the entry only leaves clusters that repair frees
+    std::vector<unsigned int> allocated = GetAllocatedClusters(entry, offset);
+    if (entry->flags & ENTRY_MAPPED)
+    {
+        //all-zero clusters stay holes, encrypted ones are stored
+        std::vector<unsigned int> map(n, HOLE);
+        unsigned int stored = 0;
+        for (unsigned int i = 0; i < n; i++)
+        {
+            size_t position = (size_t)i * clusterSize;
+            size_t size = std::min((size_t)clusterSize, data.size() - position);
+            if (encrypted || size == 0 || !IsZeroBlock(&data[position], size))
+            {
+                map[i] = 1;
+                stored++;
+            }
+        }
+        unsigned int mapClustersNeeded = (n * sizeof(unsigned int) + clusterSize - 1) / clusterSize;
+        std::vector<unsigned int> newClusters = GetFreeClusters(stored + mapClustersNeeded);
+        if (newClusters.empty())
+            return false;
+
+        std::vector<unsigned int> mapClusters(newClusters.end() - mapClustersNeeded, newClusters.end());
+        newClusters.resize(stored);
+        for (unsigned int i = 0, j = 0; i < n; i++)
+        {
+            if (map[i] != HOLE)
+                map[i] = newClusters[j++];
+        }
+        MarkClustersInFAT(newClusters, MAPPED_CLUSTER);
+        WriteClustersToFAT(mapClusters);
+        WriteFileContent(data, map);
+        WriteClusterMap(map, mapClusters);
+        entry->mapCluster = mapClusters[0];
+    }
+    else
+    {
+        std::vector<unsigned int> newClusters = GetFreeClusters(n);
+        if (newClusters.empty())
+            return false;
+
+        if (entry->flags & ENTRY_EXTENTS)
+        {
+            //new extents have to fit the first continuation slot, which is written at once,
+            //unless the caller writes them with a new entry
+            std::string newExtents = EncodeExtents(newClusters);
+            if (newExtents.empty() || (!extents && newExtents.size() > INLINE_SLOT_SIZE))
+                return false;
+            MarkClustersInFAT(newClusters, MAPPED_CLUSTER);
+            WriteFileContent(data, newClusters);
+            if (extents)
+                *extents = newExtents;
+            else
+            {
+                newExtents.resize(INLINE_SLOT_SIZE, 0);
+                WriteInlineData(newExtents, offset);
+            }
+        }
+        else
+        {
+            WriteClustersToFAT(newClusters);
+            WriteFileContent(data, newClusters);
+            entry->startingCluster = newClusters[0];
+        }
+    }
+    oldClusters = allocated;
+    return true;
+}
+
+std::vector<unsigned int> MyFileSystem::AllocateFileClusters(Entry *&entry, const std::string& fileData, bool encrypted)
+{
+    //calculate how many clusters needed
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    unsigned int clustersNeeded = (unsigned int)(std::ceil((double)entry->fileSize / clusterSize));
+    if (clustersNeeded == 0)
+        clustersNeeded++;
+
+    //find all-zero clusters, protected file is not sparse since its content is encrypted as a whole
+    std::vector<bool> holes(clustersNeeded, false);
+    unsigned int holeCount = 0;
+    if (!encrypted)
+    {
+        for (unsigned int i = 0; i < clustersNeeded; i++)
+        {
+            size_t position = (size_t)i * clusterSize;
+            size_t size = std::min((size_t)clusterSize, fileData.size() - position);
+            if (size != 0 && IsZeroBlock(&fileData[position], size))
+            {
+                holes[i] = true;
+                holeCount++;
+            }
+        }
+    }
+    //the cluster map takes 1 cluster per 512 clusters of file, only use it when it saves space
+    unsigned int mapClustersNeeded = (clustersNeeded * sizeof(unsigned int) + clusterSize - 1) / clusterSize;
+    bool sparse = holeCount > mapClustersNeeded;
+    if (sparse)
+        clustersNeeded = clustersNeeded - holeCount + mapClustersNeeded;
+
+    std::vector<unsigned int> freeClusters = GetFreeClusters(clustersNeeded);
+    if (freeClusters.empty())
+        return {};
+    if (sparse)
+    {
+        std::vector<unsigned int> mapClusters(freeClusters.end() - mapClustersNeeded, freeClusters.end());
+        freeClusters.resize(freeClusters.size() - mapClustersNeeded);
+        std::vector<unsigned int> map(holes.size(), HOLE);
+        for (unsigned int i = 0, j = 0; i < holes.size(); i++)
+        {
+            if (!holes[i])
+                map[i] = freeClusters[j++];
+        }
+
+        MarkClustersInFAT(freeClusters, MAPPED_CLUSTER);
+        WriteClustersToFAT(mapClusters);
+        WriteClusterMap(map, mapClusters);
+        entry->flags |= ENTRY_MAPPED;
+        entry->mapCluster = mapClusters[0];
+        entry->startingCluster = 0;
+        freeClusters = map;
+    }
+    else
+    {
+        //large file is described by its runs of clusters when there are few enough of them
+        std::string extents;
+        if (freeClusters.size() >= EXTENT_MIN_CLUSTERS)
+            extents = EncodeExtents(freeClusters);
+        if (!extents.empty())
+        {
+            MarkClustersInFAT(freeClusters, MAPPED_CLUSTER);
+            entry->flags |= ENTRY_EXTENTS;
+            entry->extraSlots = (extents.size() + INLINE_SLOT_SIZE - 1) / INLINE_SLOT_SIZE;
+            entry->startingCluster = 0;
+        }
+        else
+        {
+            entry->startingCluster = freeClusters[0];
+            WriteClustersToFAT(freeClusters);
+        }
+    }
+    return freeClusters;
+}
+
+void MyFileSystem::ImportFile(const std::string& inputPath, const std::string& key)
+{
+    BeginTrace();
+    std::ifstream fin(inputPath, std::ios::binary | std::ios::in);
+    if (!fin)
+    {
+        std::cout << "Path does not exist\n";
+        return;
+    }
+
     fin.seekg(0, f.end);
     unsigned int fileSize = fin.tellg();
     fin.clear();
     fin.seekg(0, f.beg);
 
-    //check file size limit
-    unsigned int limit = bytesPerSector * sectorsPerCluster * (NUMBER_OF_CLUSTERS - 1);
-    if (fileSize > limit)
+    //check file size limit
+    unsigned int limit = bytesPerSector * sectorsPerCluster * (NUMBER_OF_CLUSTERS - 1);
+    if (fileSize > limit)
+    {
+        std::cout << "File's size is too large!\n";
+        fin.close();
+        return;
+    }
+
+    //get name
+    std::string fileName = inputPath.substr(inputPath.find_last_of("/\\") + 1);
+    std::string extension = fileName.substr(fileName.find_last_of(".") + 1);
+    fileName = fileName.substr(0, fileName.find_last_of("."));
+    Entry *entry = new Entry();
+    //create short name
+    entry->SetExtension(extension);
+    unsigned int number = 1;
+    entry->SetName(fileName, number);
+    while(CheckDuplicateName(entry))
+    {
+        number++;
+        entry->SetName(fileName, number, true);
+    }
+    //get file size
+    entry->fileSize = fileSize;
+
+    //read the whole file into memory
+    std::string fileData(entry->fileSize, 0);
+    fin.read(&fileData[0], entry->fileSize);
+
+    //small file is stored in its entry, others need clusters
+    std::vector<unsigned int> freeClusters;
+    bool isInline = entry->fileSize <= INLINE_THRESHOLD;
+    if (isInline)
+    {
+        entry->flags |= ENTRY_INLINE;
+        entry->extraSlots = (entry->fileSize + INLINE_SLOT_SIZE - 1) / INLINE_SLOT_SIZE;
+        entry->startingCluster = 0;
+    }
+    else
+    {
+        freeClusters = AllocateFileClusters(entry, fileData, !key.empty());
+        if (freeClusters.empty())
+        {
+            std::cout << "Out of clusters for file!\n";
+            delete entry;
+            fin.close();
+            return;
+        }
+    }
+
+    //Create file password and encrypt file's content with a random key
+    std::string keySlot;
+    if (!key.empty())
+    {
+        entry->hasPassword = true;
+        //set password's hash
+        entry->SetHash(GenerateHash(key));
+
+        std::string dataKey(DATA_KEY_SIZE, 0);
+        CryptoPP::AutoSeededRandomPool prng;
+        prng.GenerateBlock((byte*)&dataKey[0], dataKey.size());
+        EncryptData(fileData, dataKey, entry);
+        keySlot = WrapKey(dataKey, key);
+        entry->flags |= ENTRY_WRAPPED_KEY;
+    }
+
+    //write content before the entry, a crash in between only leaves clusters that no entry owns
+    if (!isInline)
+        WriteFileContent(fileData, freeClusters);
+
+    //write entries, extents go to continuation slots like inline data, wrapped key takes the last one
+    std::string slotData;
+    if (isInline)
+        slotData = fileData;
+    else if (entry->flags & ENTRY_EXTENTS)
+        slotData = EncodeExtents(freeClusters);
+    if (!keySlot.empty())
+    {
+        slotData.resize(entry->extraSlots * INLINE_SLOT_SIZE, 0);
+        slotData += keySlot;
+        entry->extraSlots++;
+    }
+    entry->generation = ++fsInfo.generation;
+    unsigned int offset;
+    if (!WriteFileEntry(entry, slotData, &offset))
+    {
+        std::cout << "Out of space for file entry!\n";
+        FreeClusters(freeClusters);
+        delete entry;
+        fin.close();
+        return;
+    }
+    EndTrace(TRACE_IMPORT, entry->hasPassword ? TRACE_PROTECTED : 0, offset, offset, entry->fileSize);
+    
+    delete entry;
+    fin.close();
+}
+
+void MyFileSystem::ImportFile()
+{
+    std::string path;
+    std::cout << "Enter file path: ";
+    std::getline(std::cin, path);
+
+    bool hasPassword;
+    std::cout << "Do you want to set password? (1 - yes/0 - no): ";
+    std::cin >> hasPassword;
+    std::cin.ignore();
+
+    std::string key;
+    if (hasPassword)
+    {
+        std::string password;
+        std::cout << "Enter file's password: ";
+        std::cin >> password;
+        key = GenerateHash(password);
+    }
+
+    ImportFile(path, key);
+}
+
+bool MyFileSystem::CheckFilePassword(Entry *&entry, std::string& filePassword)
+{
+    std::string hashedPassword(entry->hashedPassword, entry->hashedPassword + 32);
+    std::cout << "Enter file's password: ";
+    std::cin >> filePassword;
+    std::cin.ignore();
+
+    std::string key = GenerateHash(filePassword);
+    if (GenerateHash(key) != hashedPassword)
+    {
+        std::cout << "Incorrect password!\n";
+        return false;
+    }
+
+    return true;
+}
+
+void MyFileSystem::ChangeFilePassword(Entry *&entry, unsigned int offset, bool removed)
+{
+    std::string oldKey;
+    if (entry->hasPassword)
+    {
+        std::string filePassword;
+        if (!CheckFilePassword(entry, filePassword))
+        {
+            std::cout << "Incorrect password!\n";
+            return;
+        }
+        oldKey = GenerateHash(filePassword);
+    }
+
+    std::string newKey;
+    if (!removed)
+    {
+        std::string newPassword;
+        std::cout << "Enter file's new password: ";
+        std::cin >> newPassword;
+        std::cin.ignore();
+        newKey = GenerateHash(newPassword);
+    }
+
+    BeginTrace();
+    unsigned int oldOffset = offset;
+    if (SetFileKey(entry, offset, oldKey, newKey))
+        EndTrace(TRACE_PASSWORD, (oldKey.empty() ? 0 : TRACE_PROTECTED) | (removed ? TRACE_REMOVED : 0), oldOffset, offset, entry->fileSize);
+}
+
+bool MyFileSystem::SetFileKey(Entry *&entry, unsigned int& offset, const std::string& oldKey, const std::string& newKey)
+{
+    //slots before the key slot hold inline data or extents
+    unsigned int oldSlots = entry->extraSlots;
+    std::string slotData = ReadSlotData(offset, oldSlots - ((entry->flags & ENTRY_WRAPPED_KEY) ? 1 : 0));
+    std::vector<unsigned int> replaced;
+    std::vector<unsigned int> written;
+
+    //nothing is written when the old data key cannot be unwrapped, the file would be lost
+    std::string dataKey;
+    if (!oldKey.empty() && !GetDataKey(entry, offset, oldKey, dataKey))
+        return false;
+
+    //content stays encrypted with the same data key when only its wrapped copy changes
+    if (oldKey.empty() || newKey.empty() || !(entry->flags & ENTRY_WRAPPED_KEY))
+    {
+        //damaged content is not written again, it would get checksums that hide the damage
+        std::string fileData;
+        bool verified = true;
+        if (entry->flags & ENTRY_INLINE)
+            fileData = slotData.substr(0, entry->fileSize);
+        else fileData = ReadFileContent(entry->fileSize, GetFileClusters(entry, offset), &verified);
+        if (!verified)
+            return false;
+        if (!oldKey.empty())
+            DecryptData(fileData, dataKey, entry);
+
+        //newly protected file and older protected files move to data keys
+        if (!newKey.empty())
+        {
+            dataKey.assign(DATA_KEY_SIZE, 0);
+            CryptoPP::AutoSeededRandomPool prng;
+            prng.GenerateBlock((byte*)&dataKey[0], dataKey.size());
+            EncryptData(fileData, dataKey, entry);
+        }
+
+        //new content never overwrites the old one, encrypted zeros are not zeros anymore so holes get clusters too
+        if (entry->flags & ENTRY_INLINE)
+            slotData = fileData;
+        else if (!RelocateFile(entry, offset, fileData, !newKey.empty(), replaced, &slotData))
+        {
+            std::cout << "Out of clusters for file!\n";
+            return false;
+        }
+        else if (!(entry->flags & ENTRY_EXTENTS))
+            written = GetAllocatedClusters(entry, offset);
+        else
+        {
+            for (size_t i = 0; i + EXTENT_SIZE <= slotData.size(); i += EXTENT_SIZE)
+            {
+                unsigned int extent[2];
+                memcpy(extent, &slotData[i], EXTENT_SIZE);
+                for (unsigned int j = 0; j < extent[1]; j++)
+                    written.push_back(extent[0] + j);
+            }
+        }
+    }
+    slotData.resize((slotData.size() + INLINE_SLOT_SIZE - 1) / INLINE_SLOT_SIZE * INLINE_SLOT_SIZE, 0);
+
+    //data key goes to the last slot
+    if (!newKey.empty())
+    {
+        std::string keySlot = WrapKey(dataKey, newKey);
+        keySlot.resize(INLINE_SLOT_SIZE, 0);
+        slotData += keySlot;
+        entry->flags |= ENTRY_WRAPPED_KEY;
+        entry->hasPassword = true;
+        entry->SetHash(GenerateHash(newKey));
+    }
+    else
+    {
+        entry->flags &= ~ENTRY_WRAPPED_KEY;
+        entry->hasPassword = false;
+    }
+    entry->extraSlots = slotData.size() / INLINE_SLOT_SIZE;
+    entry->generation = ++fsInfo.generation;
+
+    //changed entry goes to free slots before the old one is cleared,
+    //a crash in between leaves two copies that each match their own content
+    unsigned int oldOffset = offset;
+    if (!WriteFileEntry(entry, slotData, &offset))
+    {
+        //nothing points to the new content
+        FreeClusters(written);
+        std::cout << "Out of space for file entry!\n";
+        return false;
+    }
+    ClearSlots(oldOffset, oldSlots + 1);
+    ReleaseSlot(oldOffset);
+
+    //old content is freed once nothing points to it
+    if (!replaced.empty())
+    {
+        reclaimClusters.insert(reclaimClusters.end(), replaced.begin(), replaced.end());
+        reclaimWake.notify_one();
+    }
+    return true;
+}
+
+void MyFileSystem::ChangeFilePassword()
+{
+    std::vector<std::pair<std::string, unsigned int>> fileList = GetFileList();
+    if (fileList.empty())
+    {
+        std::cout << "There is no file!\n";
+        return;
+    }
+    PrintFileList(fileList);
+
+    //choose file
+    int choice;
+    do
+    {
+        std::cout << "Enter which file to create/change password: ";
+        std::cin >> choice;
+        std::cin.ignore();
+    } while (choice <= 0 || choice > fileList.size());
+
+    //read entry
+    Entry *e = new Entry();
+    ReadAt(fileList[choice - 1].second, (char*)e, sizeof(Entry));
+
+    bool removed = false;
+    if (e->hasPassword)
+    {
+        std::cout << "Do you want to remove this file's password (1 - yes/0 - no): ";
+        std::cin >> removed;
+        std::cin.ignore();
+    }
+    
+    ChangeFilePassword(e, fileList[choice - 1].second, removed);
+
+    //free memory
+    delete e;
+}
+
+bool MyFileSystem::ExportFile(const std::string& outputPath, Entry *&entry, unsigned int offset, std::string key)
+{
+    if (entry->hasPassword && key.empty())
+    {
+        std::string filePassword;
+        if (!CheckFilePassword(entry, filePassword))
+            return false;
+        key = GenerateHash(filePassword);
+    }
+
+    std::string dataKey;
+    if (entry->hasPassword && !GetDataKey(entry, offset, key, dataKey))
+        return false;
+
+    BeginTrace();
+    std::vector<unsigned int> fileClusters = GetFileClusters(entry, offset);
+    //unprotected content does not need to pass through memory
+    if (entry->hasPassword || (entry->flags & ENTRY_INLINE) || !CopyExportedFile(outputPath, entry, fileClusters))
+    {
+        std::string fileData;
+        bool verified = true;
+        if (entry->flags & ENTRY_INLINE)
+            fileData = ReadInlineData(entry, offset);
+        else fileData = ReadFileContent(entry->fileSize, fileClusters, &verified);
+        if (!verified)
+        {
+            std::cout << "File " << entry->GetFullName() << " is damaged and was not exported!\n";
+            return false;
+        }
+
+        if (entry->hasPassword)
+            DecryptData(fileData, dataKey, entry);
+
+        WriteExportedFile(outputPath, entry, fileData, fileClusters);
+    }
+    EndTrace(TRACE_EXPORT, entry->hasPassword ? TRACE_PROTECTED : 0, offset, offset, entry->fileSize);
+    return true;
+}
+
+void MyFileSystem::WriteExportedFile(const std::string& outputPath, Entry *&entry, const std::string& fileData, const std::vector<unsigned int>& clusters)
+{
+    std::string fileName = entry->GetFullName();
+    std::ofstream fout(outputPath + fileName, std::ios::binary | std::ios::out);
+    if (entry->flags & ENTRY_MAPPED && !entry->hasPassword)
+    {
+        //seek over holes so the exported file is sparse too
+        const size_t clusterSize = bytesPerSector * sectorsPerCluster;
+        for (size_t i = 0; i < clusters.size(); i++)
+        {
+            size_t position = i * clusterSize;
+            size_t size = std::min(clusterSize, fileData.size() - position);
+            if (clusters[i] == HOLE)
+                fout.seekp(position + size, fout.beg);
+            else fout.write(&fileData[position], size);
+        }
+        if (clusters.back() == HOLE && fileData.size() != 0)
+        {
+            fout.seekp(fileData.size() - 1, fout.beg);
+            fout.write("", 1);
+        }
+    }
+    else fout.write(&fileData[0], fileData.size());
+    fout.close();
+}
+
+bool MyFileSystem::CopyExportedFile(const std::string& outputPath, Entry *&entry, const std::vector<unsigned int>& clusters)
+{
+#ifdef __linux__
+    if (fd == -1)
+        return false;
+
+    //the kernel cannot check clusters against their checksums, so checksummed files take the buffered path
+    if (LoadChecksums())
+        for (unsigned int cluster : clusters)
+            if (cluster != HOLE && checksums[cluster] != NO_CHECKSUM)
+                return false;
+
+    int out = open((outputPath + entry->GetFullName()).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out == -1)
+        return false;
+
+    //pending writes must reach the host file before the kernel reads it
+    Flush();
+
+    //each run of consecutive clusters is one copy, holes are skipped so the output stays sparse
+    //copy_file_range can share blocks on reflink-capable hosts, sendfile is used where it is not supported
+    const size_t clusterSize = bytesPerSector * sectorsPerCluster;
+    const size_t fileSize = entry->fileSize;
+    bool useSendfile = false;
+    bool result = true;
+    size_t k = 0;
+    while (result && k < clusters.size() && k * clusterSize < fileSize)
+    {
+        if (clusters[k] == HOLE)
+        {
+            k++;
+            continue;
+        }
+        size_t j = k + 1;
+        while (j < clusters.size() && clusters[j] == clusters[j - 1] + 1)
+            j++;
+
+        //a striped run is copied piece by piece from each backing file
+        size_t runSize = std::min((j - k) * clusterSize, fileSize - k * clusterSize);
+        for (const HostRun& run : MapHostRange(GetClusterOffset(clusters[k]), runSize))
+        {
+            int in = HostFd(run.file);
+            loff_t inOffset = run.offset;
+            loff_t outOffset = k * clusterSize + run.position;
+            size_t remaining = run.size;
+            while (in != -1 && remaining)
+            {
+                ssize_t copied = -1;
+                if (!useSendfile)
+                {
+                    copied = copy_file_range(in, &inOffset, out, &outOffset, remaining, 0);
+                    if (copied == -1 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+                        useSendfile = true;
+                }
+                if (useSendfile)
+                {
+                    off_t sendOffset = inOffset;
+                    if (lseek(out, outOffset, SEEK_SET) == -1)
+                        break;
+                    copied = sendfile(out, in, &sendOffset, remaining);
+                    if (copied > 0)
+                    {
+                        inOffset += copied;
+                        outOffset += copied;
+                    }
+                }
+                if (copied <= 0)
+                    break;
+                remaining -= copied;
+            }
+            result = result && remaining == 0;
+        }
+        k = j;
+    }
+
+    //file ending in holes gets its size here
+    if (result)
+        result = ftruncate(out, fileSize) == 0;
+    close(out);
+    return result;
+#else
+    return false;
+#endif
+}
+
+void MyFileSystem::ExportFile()
+{
+    //list file
+    std::vector<std::pair<std::string, unsigned int>> fileList = GetFileList();
+    if (fileList.empty())
     {
-        std::cout << "File's size is too large!\n";
-        fin.close();
+        std::cout << "There is no file!\n";
         return;
     }
+    PrintFileList(fileList);
+    std::cout << '\n';
 
-    //get name
-    std::string fileName = inputPath.substr(inputPath.find_last_of("/\\") + 1);
-    std::string extension = fileName.substr(fileName.find_last_of(".") + 1);
-    fileName = fileName.substr(0, fileName.find_last_of("."));
-    Entry *entry = new Entry();
-    //create short name
-    entry->SetExtension(extension);
-    unsigned int number = 1;
-    entry->SetName(fileName, number);
-    while(CheckDuplicateName(entry))
+    //choose file
+    int choice;
+    do
+    {
+        std::cout << "Enter which file to export: ";
+        std::cin >> choice;
+        std::cin.ignore();
+    } while (choice <= 0 || choice > fileList.size());
+    
+    std::string path;
+    std::cout << "Enter output path: ";
+    std::getline(std::cin, path);
+    if (path[path.size() - 1] != '\\')
+        path += '\\';
+
+    //read entry
+    Entry *e = new Entry();
+    ReadAt(fileList[choice - 1].second, (char*)e, sizeof(Entry));
+    
+    //export
+    ExportFile(path, e, fileList[choice - 1].second);
+
+    //free memory
+    delete e;
+}
+
+std::vector<std::pair<std::string, unsigned int>> MyFileSystem::GetFileList(bool getDeleted) {
+    std::vector<std::pair<std::string, unsigned int>> fileList;
+    std::vector<unsigned int> rdetClusters = GetClustersChain(STARTING_CLUSTER);
+    for (unsigned int cluster : rdetClusters)
+    {
+        unsigned int sectorOffset = sectorsBeforeFat + fatSize + sectorsPerCluster * (cluster - STARTING_CLUSTER);
+        unsigned int bytesOffset = sectorOffset * bytesPerSector;
+        unsigned int limitOffset = bytesOffset + bytesPerSector * sectorsPerCluster;  //start of next cluster
+        for (; bytesOffset < limitOffset; bytesOffset += sizeof(Entry))
+        {
+            Entry tempEntry;
+            ReadAt(bytesOffset, (char*)&tempEntry, sizeof(Entry));
+            //sign of erased file
+            if (tempEntry.name[0] == -27 && getDeleted)
+            {
+                //if the file is not restorable
+                if (tempEntry.reserved[0] == 0)
+                    continue;
+
+                //if the file is restorable
+                std::string fileName = tempEntry.GetInfo();
+                fileName[0] = tempEntry.reserved[0];
+                fileList.push_back(std::make_pair(fileName, bytesOffset));
+            }
+            //sign of empty entry
+            else if (tempEntry.name[0] == 0)
+            {
+                return fileList;
+            }
+            //data of previous entry
+            else if (tempEntry.name[0] == ENTRY_CONTINUATION)
+                continue;
+
+            if (tempEntry.name[0] != -27 && !getDeleted)
+                fileList.push_back(std::make_pair(tempEntry.GetInfo(), bytesOffset));
+        }
+    }
+    return fileList;
+}
+
+void MyFileSystem::PrintFileList(const std::vector<std::pair<std::string, unsigned int>>& fileList)
+{
+    int i = 1;
+    for (std::pair<std::string, int> p : fileList)
+    {
+        std::cout << i++ << ". " << p.first << '\n';
+    }
+}
+
+void MyFileSystem::BuildIndex()
+{
+    nameIndex.clear();
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+    bool end = false;
+    for (size_t c = 0; c < rdet.size() && !end; c++)
+    {
+        unsigned int clusterOffset = GetClusterOffset(rdetClusters[c]);
+        for (size_t slot = 0; slot < rdet[c].size(); slot += sizeof(Entry))
+        {
+            Entry *e = (Entry*)&rdet[c][slot];
+            if (e->name[0] == 0)
+            {
+                end = true;
+                break;
+            }
+            if (e->name[0] == ENTRY_CONTINUATION || (e->name[0] == -27 && e->reserved[0] == 0))
+                continue;
+
+            IndexEntry item;
+            item.entry = *e;
+            item.offset = clusterOffset + slot;
+            item.deleted = e->name[0] == -27;
+            //deleted file is shown with its real first character
+            if (item.deleted)
+                item.entry.name[0] = e->reserved[0];
+            item.name = item.entry.GetFullName().c_str();
+            nameIndex.push_back(item);
+        }
+    }
+
+    std::sort(nameIndex.begin(), nameIndex.end(), [](const IndexEntry& a, const IndexEntry& b)
+    {
+        return a.name != b.name ? a.name < b.name : a.offset < b.offset;
+    });
+    sizeIndex.resize(nameIndex.size());
+    for (size_t i = 0; i < sizeIndex.size(); i++)
+        sizeIndex[i] = i;
+    std::stable_sort(sizeIndex.begin(), sizeIndex.end(), [this](size_t a, size_t b)
+    {
+        return nameIndex[a].entry.fileSize < nameIndex[b].entry.fileSize;
+    });
+    indexValid = true;
+}
+
+void MyFileSystem::QueryFiles()
+{
+    std::string prefix;
+    std::cout << "Enter name prefix (empty - any name): ";
+    std::getline(std::cin, prefix);
+
+    unsigned int minSize, maxSize;
+    std::cout << "Enter smallest size in bytes: ";
+    std::cin >> minSize;
+    std::cout << "Enter largest size in bytes (0 - no limit): ";
+    std::cin >> maxSize;
+    if (maxSize == 0)
+        maxSize = UINT_MAX;
+
+    int status;
+    std::cout << "Show (0 - files/1 - restorable deleted files/2 - both): ";
+    std::cin >> status;
+
+    bool bySize;
+    std::cout << "Sort by (0 - name/1 - size): ";
+    std::cin >> bySize;
+
+    unsigned int pageSize;
+    std::cout << "Enter page size: ";
+    std::cin >> pageSize;
+    std::cin.ignore();
+    if (pageSize == 0)
+        pageSize = 1;
+
+    if (!indexValid)
+        BuildIndex();
+
+    //the sort key narrows the range, other conditions are checked on each entry
+    size_t first, last;
+    if (bySize)
+    {
+        first = std::lower_bound(sizeIndex.begin(), sizeIndex.end(), minSize, [this](size_t i, unsigned int size)
+        {
+            return nameIndex[i].entry.fileSize < size;
+        }) - sizeIndex.begin();
+        last = std::upper_bound(sizeIndex.begin(), sizeIndex.end(), maxSize, [this](unsigned int size, size_t i)
+        {
+            return size < nameIndex[i].entry.fileSize;
+        }) - sizeIndex.begin();
+    }
+    else
+    {
+        first = std::lower_bound(nameIndex.begin(), nameIndex.end(), prefix, [](const IndexEntry& item, const std::string& name)
+        {
+            return item.name < name;
+        }) - nameIndex.begin();
+        last = first;
+        while (last < nameIndex.size() && nameIndex[last].name.compare(0, prefix.size(), prefix) == 0)
+            last++;
+    }
+
+    //pages are found by skipping earlier matches
+    unsigned int page = 1;
+    while (page != 0)
+    {
+        size_t skipped = 0, shown = 0;
+        for (size_t k = first; k < last && shown < pageSize; k++)
+        {
+            const IndexEntry& item = nameIndex[bySize ? sizeIndex[k] : k];
+            if (item.name.compare(0, prefix.size(), prefix) != 0 || item.entry.fileSize < minSize || item.entry.fileSize > maxSize)
+                continue;
+            if ((status == 0 && item.deleted) || (status == 1 && !item.deleted))
+                continue;
+            if (skipped++ < (size_t)(page - 1) * pageSize)
+                continue;
+
+            std::cout << skipped << ". " << item.entry.GetInfo() << (item.deleted ? "  (deleted)" : "") << '\n';
+            shown++;
+        }
+        if (shown == 0)
+            std::cout << "No more files\n";
+
+        std::cout << "Enter page number (0 - stop): ";
+        std::cin >> page;
+        std::cin.ignore();
+    }
+}
+
+void MyFileSystem::ListFiles() 
+{
+    BeginTrace();
+    std::vector<std::pair<std::string, unsigned int>> fileList = MyFileSystem::GetFileList();
+    if (fileList.empty())
+    {
+        std::cout << "There is no file\n";
+    }
+    else PrintFileList(fileList);
+
+    const double clusterSize = bytesPerSector * sectorsPerCluster;
+    std::cout << std::fixed << std::setprecision(2) << "Free space: " << fsInfo.freeClusters * clusterSize / 1000000
+        << " MB of " << (FINAL_CLUSTER - STARTING_CLUSTER) * clusterSize / 1000000 << " MB\n";
+    std::cout.unsetf(std::ios::fixed);
+    EndTrace(TRACE_LIST, 0, 0, fileList.size(), 0);
+}
+
+void MyFileSystem::MyDeleteFile(unsigned int bytesOffset, bool restorable, std::string key) 
+{
+    Entry e;
+    ReadAt(bytesOffset, (char*)&e, sizeof(Entry));
+
+    //check file password
+    if (e.hasPassword)
+    {
+        Entry *pE = &e;
+        std::string password;
+        if (key.empty() ? !CheckFilePassword(pE, password) : GenerateHash(key) != std::string(e.hashedPassword, e.hashedPassword + 32))
+        {
+            std::cout << "Incorrect password!\n";
+            return;
+        }
+    }
+
+    BeginTrace();
+    unsigned char deleteValue = 0xE5;
+    //store first byte of name and delete stamp if restorable
+    if (restorable)
+    {
+        e.reserved[0] = e.name[0];
+        e.SetDeleteStamp(++fsInfo.deleteStamp);
+        WriteAt(bytesOffset + ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH, e.reserved, sizeof(e.reserved));
+    }
+    e.generation = ++fsInfo.generation;
+    WriteAt(bytesOffset + offsetof(Entry, generation), (char*)&e.generation, sizeof(e.generation));
+    //mark first byte as E5
+    WriteAt(bytesOffset, (char*)&deleteValue, sizeof(deleteValue));
+
+    //queue clusters for the reclaimer if not restorable, entry is committed first so it never points to freed clusters
+    if(!restorable)
+    {
+        Flush();
+        Entry *pE = &e;
+        QueueReclaim(pE, bytesOffset);
+        ClearSlots(bytesOffset + sizeof(Entry), e.extraSlots);
+        ReleaseSlot(bytesOffset);
+    }
+    Flush();
+    indexValid = false;
+    EndTrace(TRACE_DELETE, (e.hasPassword ? TRACE_PROTECTED : 0) | (restorable ? TRACE_RESTORABLE : 0), bytesOffset, bytesOffset, e.fileSize);
+}
+
+void MyFileSystem::MyDeleteFile()
+{
+    //list file
+    std::vector<std::pair<std::string, unsigned int>> fileList = GetFileList();
+    if (fileList.empty())
+    {
+        std::cout << "There is no file!\n";
+        return;
+    }
+    PrintFileList(fileList);
+    std::cout << '\n';
+
+    //choose file
+    int choice;
+    do
+    {
+        std::cout << "Enter which file to delete: ";
+        std::cin >> choice;
+        std::cin.ignore();
+    } while (choice <= 0 || choice > fileList.size());
+
+    unsigned int bytesOffset = fileList[choice - 1].second;
+
+    bool restorable;
+    std::cout << "Do you want this to be restorable (1 - yes/0 - no): ";
+    std::cin >> restorable;
+    std::cin.ignore();
+    MyDeleteFile(bytesOffset, restorable);
+}
+
+void MyFileSystem::RestoreFile(unsigned int bytesOffset) 
+{
+    BeginTrace();
+    Entry e;
+    Entry *pE = nullptr;
+    ReadAt(bytesOffset, (char*)&e, sizeof(Entry));
+    pE = &e;
+
+    e.name[0] = e.reserved[0];
+    e.reserved[0] = 0;
+    e.SetDeleteStamp(0);
+
+    //check duplicate name
+    int number = std::atoi(e.GetIndex().c_str());
+    std::string fileName(e.name, e.name + e.nameLen);
+    while (CheckDuplicateName(pE))
+    {
+        number++;
+        e.SetName(fileName, number, true);
+    }
+
+    //rewrite entry
+    e.generation = ++fsInfo.generation;
+    WriteAt(bytesOffset, (char*)&e, sizeof(Entry));
+    Flush();
+    indexValid = false;
+    EndTrace(TRACE_RESTORE, e.hasPassword ? TRACE_PROTECTED : 0, bytesOffset, bytesOffset, e.fileSize);
+}
+
+void MyFileSystem::MyRestoreFile() 
+{
+    std::vector<std::pair<std::string, unsigned int>> fileList = GetFileList(true);
+    if (fileList.size() == 0)
+    {
+        std::cout << "There is no file to restore!\n";
+        return;
+    }
+
+    std::cout << "Restorable Deleted File List:\n";
+    PrintFileList(fileList);
+    std::cout << '\n';
+
+    //choose file
+    int choice;
+    do
+    {
+        std::cout << "Enter which file to restore: ";
+        std::cin >> choice;
+        std::cin.ignore();
+    } while (choice <= 0 || choice > fileList.size());
+
+    unsigned int bytesOffset = fileList[choice - 1].second;
+    RestoreFile(bytesOffset);
+}
+
+bool MyFileSystem::CloneFile(unsigned int bytesOffset)
+{
+    BeginTrace();
+    Entry e;
+    ReadAt(bytesOffset, (char*)&e, sizeof(Entry));
+    Entry *pE = &e;
+
+    Entry clone = e;
+    Entry *pClone = &clone;
+    int number = std::atoi(e.GetIndex().c_str());
+    std::string fileName(e.name, e.name + e.nameLen);
+    while (CheckDuplicateName(pClone))
     {
         number++;
-        entry->SetName(fileName, number, true);
+        clone.SetName(fileName, number, true);
     }
-    //get file size
-    entry->fileSize = fileSize;
 
-    //find free cluster and write to FAT
-    //calculate how many clusters needed
-    unsigned int clustersNeeded = (unsigned int)(std::ceil((double)entry->fileSize / (bytesPerSector * sectorsPerCluster)));
-    if (clustersNeeded == 0)
-        clustersNeeded++;
-    std::vector<unsigned int> freeClusters = GetFreeClusters(clustersNeeded);
-    if (freeClusters.empty())
+    //small file is copied, it does not have clusters to share
+    unsigned int cloneOffset;
+    clone.generation = ++fsInfo.generation;
+    if (e.flags & ENTRY_INLINE)
     {
-        std::cout << "Out of clusters for file!\n";
-        delete entry;
-        fin.close();
-        return;
+        if (!WriteFileEntry(pClone, ReadSlotData(bytesOffset, e.extraSlots), &cloneOffset))
+            return false;
+        EndTrace(TRACE_CLONE, e.hasPassword ? TRACE_PROTECTED : 0, bytesOffset, cloneOffset, e.fileSize);
+        return true;
     }
-    entry->startingCluster = freeClusters[0];
-    WriteClustersToFAT(freeClusters);
 
-    //read the whole file into memory
-    std::string fileData(entry->fileSize, 0);
-    fin.read(&fileData[0], entry->fileSize);
+    //only files with a cluster map can share clusters one by one
+    if (!ConvertToClusterMap(pE, bytesOffset) || !LoadShareCounts(true))
+        return false;
 
-    //Create file password and encrypt file's content
-    if (hasPassword)
+    std::vector<unsigned int> clusters = ReadClusterMap(pE);
+    std::vector<unsigned int> shared;
+    for (unsigned int cluster : clusters)
     {
-        entry->hasPassword = true;
-        //set password's hash
-        std::string password;
-        std::cout << "Enter file's password: ";
-        std::cin >> password;
-
-        std::string hashedPassword = GenerateHash(password);
-        std::string doublyHashedPassword = GenerateHash(hashedPassword);
-        entry->SetHash(doublyHashedPassword);
+        if (cluster == HOLE)
+            continue;
+        if (shareCounts[cluster] == MAX_SHARE_COUNT)
+            return false;
+        shared.push_back(cluster);
+    }
 
-        EncryptData(fileData, hashedPassword, entry);
+    //clone gets its own copy of the cluster map
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    std::vector<unsigned int> mapClusters = GetFreeClusters((clusters.size() * sizeof(unsigned int) + clusterSize - 1) / clusterSize);
+    if (mapClusters.empty())
+        return false;
+    WriteClustersToFAT(mapClusters);
+    WriteClusterMap(clusters, mapClusters);
+    clone.flags = e.flags;
+    clone.extraSlots = e.extraSlots;
+    clone.mapCluster = mapClusters[0];
+    clone.startingCluster = 0;
+    //clone keeps its own copy of the wrapped key
+    if (!WriteFileEntry(pClone, ReadSlotData(bytesOffset, e.extraSlots), &cloneOffset))
+    {
+        FreeClusters(mapClusters);
+        return false;
     }
 
-    //write entries
-    if (!WriteFileEntry(entry))
+    for (unsigned int cluster : shared)
+        shareCounts[cluster]++;
+    WriteShareCounts(shared);
+    EndTrace(TRACE_CLONE, e.hasPassword ? TRACE_PROTECTED : 0, bytesOffset, cloneOffset, e.fileSize);
+    return true;
+}
+
+void MyFileSystem::CloneFile()
+{
+    //list file
+    std::vector<std::pair<std::string, unsigned int>> fileList = GetFileList();
+    if (fileList.empty())
     {
-        std::cout << "Out of space for file entry!\n";
-        delete entry;
-        fin.close();
+        std::cout << "There is no file!\n";
         return;
     }
+    PrintFileList(fileList);
+    std::cout << '\n';
 
-    //write file's content
-    WriteFileContent(fileData, freeClusters);
-    
-    delete entry;
-    fin.close();
+    //choose file
+    int choice;
+    do
+    {
+        std::cout << "Enter which file to clone: ";
+        std::cin >> choice;
+        std::cin.ignore();
+    } while (choice <= 0 || choice > (int)fileList.size());
+
+    if (!CloneFile(fileList[choice - 1].second))
+        std::cout << "Out of space for clone!\n";
 }
 
-void MyFileSystem::ImportFile()
+bool MyFileSystem::CompilePattern(const std::string& pattern, std::regex& regex)
 {
-    std::string path;
-    std::cout << "Enter file path: ";
-    std::getline(std::cin, path);
+    if (pattern.compare(0, 3, "re:") != 0)
+        return true;
+    try
+    {
+        regex.assign(pattern.substr(3));
+    }
+    catch (const std::regex_error&)
+    {
+        std::cout << "Invalid pattern!\n";
+        return false;
+    }
+    return true;
+}
 
-    bool hasPassword;
-    std::cout << "Do you want to set password? (1 - yes/0 - no): ";
-    std::cin >> hasPassword;
-    std::cin.ignore();
+bool MyFileSystem::MatchName(const std::string& pattern, const std::regex& regex, const std::string& fullName)
+{
+    //short extension is padded with null characters
+    const std::string name = fullName.c_str();
+    if (pattern.compare(0, 3, "re:") == 0)
+        return std::regex_match(name, regex);
 
-    ImportFile(path, hasPassword);
+    //glob, backtrack to the last star on mismatch
+    size_t p = 0, n = 0;
+    size_t star = std::string::npos, starName = 0;
+    while (n < name.size())
+    {
+        if (p < pattern.size() && (pattern[p] == '?' || pattern[p] == name[n]))
+        {
+            p++;
+            n++;
+        }
+        else if (p < pattern.size() && pattern[p] == '*')
+        {
+            star = p++;
+            starName = n;
+        }
+        else if (star != std::string::npos)
+        {
+            p = star + 1;
+            n = ++starName;
+        }
+        else return false;
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+        p++;
+    return p == pattern.size();
 }
 
-bool MyFileSystem::CheckFilePassword(Entry *&entry, std::string& filePassword)
+std::vector<std::vector<char>> MyFileSystem::ReadRDET(std::vector<unsigned int>& rdetClusters)
 {
-    std::string hashedPassword(entry->hashedPassword, entry->hashedPassword + 32);
-    std::cout << "Enter file's password: ";
-    std::cin >> filePassword;
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    rdetClusters = GetClustersChain(STARTING_CLUSTER);
+    std::vector<std::vector<char>> rdet;
+    for (unsigned int cluster : rdetClusters)
+        rdet.push_back(ReadBlock(GetClusterOffset(cluster), clusterSize));
+    return rdet;
+}
+
+std::string MyFileSystem::AskBulkPassword(std::string& key)
+{
+    std::string password;
+    std::cout << "Enter password for protected files: ";
+    std::cin >> password;
     std::cin.ignore();
+    key = GenerateHash(password);
+    return GenerateHash(key);
+}
 
-    std::string key = GenerateHash(filePassword);
-    if (GenerateHash(key) != hashedPassword)
+void MyFileSystem::BulkDelete(const std::string& pattern, bool restorable, std::string key)
+{
+    std::regex regex;
+    if (!CompilePattern(pattern, regex))
+        return;
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+    std::vector<bool> changed(rdet.size(), false);
+    std::string doublyHashedPassword = key.empty() ? "" : GenerateHash(key);
+    int deleted = 0, skipped = 0;
+
+    bool end = false;
+    for (size_t c = 0; c < rdet.size() && !end; c++)
     {
-        std::cout << "Incorrect password!\n";
-        return false;
+        for (size_t slot = 0; slot < rdet[c].size(); slot += sizeof(Entry))
+        {
+            Entry *e = (Entry*)&rdet[c][slot];
+            if (e->name[0] == 0)
+            {
+                end = true;
+                break;
+            }
+            if (e->name[0] == -27 || e->name[0] == ENTRY_CONTINUATION || !MatchName(pattern, regex, e->GetFullName()))
+                continue;
+
+            if (e->hasPassword)
+            {
+                if (doublyHashedPassword.empty())
+                    doublyHashedPassword = AskBulkPassword(key);
+                if (doublyHashedPassword != std::string(e->hashedPassword, e->hashedPassword + 32))
+                {
+                    skipped++;
+                    continue;
+                }
+            }
+
+            if (restorable)
+            {
+                e->reserved[0] = e->name[0];
+                e->SetDeleteStamp(++fsInfo.deleteStamp);
+            }
+            else
+            {
+                QueueReclaim(e, GetClusterOffset(rdetClusters[c]) + slot);
+                //release continuation slots
+                for (unsigned int i = 1; i <= e->extraSlots; i++)
+                {
+                    std::fill(&rdet[c][slot + i * sizeof(Entry)], &rdet[c][slot + (i + 1) * sizeof(Entry)], 0);
+                    rdet[c][slot + i * sizeof(Entry)] = (char)0xE5;
+                }
+                e->reserved[0] = 0;
+                fsInfo.firstFreeSlot = std::min(fsInfo.firstFreeSlot, (unsigned int)(c * rdet[c].size() + slot));
+            }
+            e->name[0] = (char)0xE5;
+            e->generation = ++fsInfo.generation;
+            changed[c] = true;
+            deleted++;
+        }
     }
 
-    return true;
+    //commit entries before the reclaimer frees their clusters
+    for (size_t c = 0; c < rdet.size(); c++)
+    {
+        if (!changed[c])
+            continue;
+        WriteAt(GetClusterOffset(rdetClusters[c]), &rdet[c][0], rdet[c].size());
+    }
+    Flush();
+    indexValid = false;
+
+    std::cout << "Deleted " << deleted << " files";
+    if (skipped)
+        std::cout << ", skipped " << skipped << " files with other passwords";
+    std::cout << '\n';
 }
 
-void MyFileSystem::ChangeFilePassword(Entry *&entry, unsigned int offset, bool removed)
+void MyFileSystem::BulkRestore(const std::string& pattern)
 {
-    std::vector<unsigned int> fileClusters = GetClustersChain(entry->startingCluster);
-    std::string fileData = ReadFileContent(entry->fileSize, fileClusters);
-    if (entry->hasPassword)
+    std::regex regex;
+    if (!CompilePattern(pattern, regex))
+        return;
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+    std::vector<bool> changed(rdet.size(), false);
+
+    //names in use and restorable entries, collected in one pass
+    std::set<std::string> names;
+    std::vector<std::pair<size_t, Entry*>> restorable;
+    bool end = false;
+    for (size_t c = 0; c < rdet.size() && !end; c++)
     {
-        std::string filePassword;
-        if (!CheckFilePassword(entry, filePassword))
+        for (size_t slot = 0; slot < rdet[c].size(); slot += sizeof(Entry))
         {
-            std::cout << "Incorrect password!\n";
-            return;
+            Entry *e = (Entry*)&rdet[c][slot];
+            if (e->name[0] == 0)
+            {
+                end = true;
+                break;
+            }
+            if (e->name[0] == ENTRY_CONTINUATION)
+                continue;
+            if (e->name[0] != -27)
+            {
+                names.insert(std::string(e->name, e->name + ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH));
+                continue;
+            }
+            if (e->reserved[0] == 0)
+                continue;
+
+            Entry original = *e;
+            original.name[0] = original.reserved[0];
+            if (MatchName(pattern, regex, original.GetFullName()))
+                restorable.push_back(std::make_pair(c, e));
         }
+    }
+
+    for (std::pair<size_t, Entry*> p : restorable)
+    {
+        Entry *e = p.second;
+        e->name[0] = e->reserved[0];
+        e->reserved[0] = 0;
+        e->SetDeleteStamp(0);
+        e->generation = ++fsInfo.generation;
 
-        DecryptData(fileData, GenerateHash(filePassword), entry);
+        int number = std::atoi(e->GetIndex().c_str());
+        std::string fileName(e->name, e->name + e->nameLen);
+        while (names.count(std::string(e->name, e->name + ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH)))
+        {
+            number++;
+            e->SetName(fileName, number, true);
+        }
+        names.insert(std::string(e->name, e->name + ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH));
+        changed[p.first] = true;
     }
 
-    if (!removed)
+    for (size_t c = 0; c < rdet.size(); c++)
     {
-        std::string newPassword;
-        std::cout << "Enter file's new password: ";
-        std::cin >> newPassword;
-        std::cin.ignore();
+        if (!changed[c])
+            continue;
+        WriteAt(GetClusterOffset(rdetClusters[c]), &rdet[c][0], rdet[c].size());
+    }
+    Flush();
+    indexValid = false;
+    std::cout << "Restored " << restorable.size() << " files\n";
+}
 
-        std::string hashedPassword = GenerateHash(newPassword);
-        std::string doublyHashedPassword = GenerateHash(hashedPassword);
-        entry->SetHash(doublyHashedPassword);
+void MyFileSystem::BulkExport(const std::string& pattern, const std::string& outputPath)
+{
+    std::regex regex;
+    if (!CompilePattern(pattern, regex))
+        return;
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+    std::string key, doublyHashedPassword;
+    int exported = 0, skipped = 0, failed = 0;
 
-        EncryptData(fileData, hashedPassword, entry);
-        entry->hasPassword = true;
+    bool end = false;
+    for (size_t c = 0; c < rdet.size() && !end; c++)
+    {
+        unsigned int clusterOffset = GetClusterOffset(rdetClusters[c]);
+        for (size_t slot = 0; slot < rdet[c].size(); slot += sizeof(Entry))
+        {
+            Entry *e = (Entry*)&rdet[c][slot];
+            if (e->name[0] == 0)
+            {
+                end = true;
+                break;
+            }
+            if (e->name[0] == -27 || e->name[0] == ENTRY_CONTINUATION || !MatchName(pattern, regex, e->GetFullName()))
+                continue;
+
+            if (e->hasPassword)
+            {
+                if (doublyHashedPassword.empty())
+                    doublyHashedPassword = AskBulkPassword(key);
+                if (doublyHashedPassword != std::string(e->hashedPassword, e->hashedPassword + 32))
+                {
+                    skipped++;
+                    continue;
+                }
+            }
+            if (ExportFile(outputPath, e, clusterOffset + slot, key))
+                exported++;
+            else failed++;
+        }
     }
-    else entry->hasPassword = false;
-    
-    //rewrite data
-    WriteFileContent(fileData, fileClusters);
 
-    //rewrite file entry
-    f.seekp(offset, f.beg);
-    f.write((char*)entry, sizeof(Entry));
-    f.flush();
+    std::cout << "Exported " << exported << " files";
+    if (skipped)
+        std::cout << ", skipped " << skipped << " files with other passwords";
+    if (failed)
+        std::cout << ", " << failed << " files failed";
+    std::cout << '\n';
 }
 
-void MyFileSystem::ChangeFilePassword()
+void MyFileSystem::ParallelExport(const std::string& pattern, const std::string& outputPath, unsigned int threadCount)
 {
-    std::vector<std::pair<std::string, unsigned int>> fileList = GetFileList();
-    if (fileList.empty())
+    struct Job
     {
-        std::cout << "There is no file!\n";
+        Entry entry;
+        std::vector<unsigned int> clusters;
+        std::string inlineData;
+        std::string dataKey;
+        unsigned int firstCluster;
+    };
+
+    std::regex regex;
+    if (!CompilePattern(pattern, regex))
         return;
+
+    //collect files and resolve their clusters on this thread, the FAT is read through the main stream
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+    std::map<std::string, Job> jobsByName;
+    std::string key, doublyHashedPassword;
+    int skipped = 0;
+    bool end = false;
+    for (size_t c = 0; c < rdet.size() && !end; c++)
+    {
+        unsigned int clusterOffset = GetClusterOffset(rdetClusters[c]);
+        for (size_t slot = 0; slot < rdet[c].size(); slot += sizeof(Entry))
+        {
+            Entry *e = (Entry*)&rdet[c][slot];
+            if (e->name[0] == 0)
+            {
+                end = true;
+                break;
+            }
+            if (e->name[0] == -27 || e->name[0] == ENTRY_CONTINUATION || !MatchName(pattern, regex, e->GetFullName()))
+                continue;
+
+            if (e->hasPassword)
+            {
+                if (doublyHashedPassword.empty())
+                    doublyHashedPassword = AskBulkPassword(key);
+                if (doublyHashedPassword != std::string(e->hashedPassword, e->hashedPassword + 32))
+                {
+                    skipped++;
+                    continue;
+                }
+            }
+
+            //files with the same name overwrite each other, the last one wins like in sequential export
+            Job job;
+            job.entry = *e;
+            job.clusters = GetFileClusters(e, clusterOffset + slot);
+            if (e->flags & ENTRY_INLINE)
+                job.inlineData = ReadInlineData(e, clusterOffset + slot);
+            if (e->hasPassword && !GetDataKey(e, clusterOffset + slot, key, job.dataKey))
+                continue;
+            job.firstCluster = 0;
+            for (unsigned int cluster : job.clusters)
+            {
+                if (cluster != HOLE)
+                {
+                    job.firstCluster = cluster;
+                    break;
+                }
+            }
+            jobsByName[e->GetFullName()] = job;
+        }
     }
-    PrintFileList(fileList);
 
-    //choose file
-    int choice;
-    do
+    //visit files in order of their location so reads of the volume are mostly sequential
+    std::vector<Job*> jobs;
+    for (std::pair<const std::string, Job>& p : jobsByName)
+        jobs.push_back(&p.second);
+    std::sort(jobs.begin(), jobs.end(), [](const Job *a, const Job *b) { return a->firstCluster < b->firstCluster; });
+
+    //workers read the host file directly and verify against a table loaded before they start
+    Flush();
+    LoadChecksums();
+    if (threadCount == 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    threadCount = std::min(threadCount, (unsigned int)std::max((size_t)1, jobs.size()));
+
+    std::atomic<size_t> next(0);
+    std::atomic<int> failed(0);
+    std::atomic<int> exported(0);
+    std::atomic<int> damaged(0);
+    std::vector<std::thread> workers;
+    for (unsigned int t = 0; t < threadCount; t++)
     {
-        std::cout << "Enter which file to create/change password: ";
-        std::cin >> choice;
-        std::cin.ignore();
-    } while (choice <= 0 || choice > fileList.size());
+        workers.emplace_back([&]()
+        {
+            std::vector<std::ifstream> in = OpenStreams();
+            if (in.empty())
+            {
+                failed++;
+                return;
+            }
+            //while one worker decrypts or writes to host, others keep reading the volume
+            for (size_t i = next++; i < jobs.size(); i = next++)
+            {
+                Entry *e = &jobs[i]->entry;
+                std::string fileData;
+                bool verified = true;
+                if (e->flags & ENTRY_INLINE)
+                    fileData = jobs[i]->inlineData;
+                else fileData = ReadFileContent(&in, e->fileSize, jobs[i]->clusters, &verified);
+                if (!verified)
+                {
+                    damaged++;
+                    continue;
+                }
 
-    //read entry
-    f.seekg(fileList[choice - 1].second);
-    Entry *e = new Entry();
-    f.read((char*)e, sizeof(Entry));
+                if (e->hasPassword)
+                    DecryptData(fileData, jobs[i]->dataKey, e);
+                WriteExportedFile(outputPath, e, fileData, jobs[i]->clusters);
+                exported++;
+            }
+        });
+    }
+    for (std::thread& worker : workers)
+        worker.join();
 
-    bool removed = false;
-    if (e->hasPassword)
+    if (failed)
+        std::cout << "Cannot open file system for reading!\n";
+    std::cout << "Exported " << exported << " files with " << threadCount << " threads";
+    if (skipped)
+        std::cout << ", skipped " << skipped << " files with other passwords";
+    if (damaged)
+        std::cout << ", " << damaged << " damaged files failed";
+    std::cout << '\n';
+}
+
+void MyFileSystem::BulkChangePassword(const std::string& pattern, std::string oldKey, std::string newKey)
+{
+    std::regex regex;
+    if (!CompilePattern(pattern, regex))
+        return;
+    std::string oldHash = oldKey.empty() ? AskBulkPassword(oldKey) : GenerateHash(oldKey);
+    if (newKey.empty())
     {
-        std::cout << "Do you want to remove this file's password (1 - yes/0 - no): ";
-        std::cin >> removed;
+        std::string newPassword;
+        std::cout << "Enter new password: ";
+        std::cin >> newPassword;
         std::cin.ignore();
+        newKey = GenerateHash(newPassword);
     }
-    
-    ChangeFilePassword(e, fileList[choice - 1].second, removed);
 
-    //free memory
-    delete e;
+    //files are collected first since each change moves its entry to free slots
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+    std::vector<unsigned int> offsets;
+    bool end = false;
+    for (size_t c = 0; c < rdet.size() && !end; c++)
+    {
+        for (size_t slot = 0; slot < rdet[c].size(); slot += sizeof(Entry))
+        {
+            Entry *e = (Entry*)&rdet[c][slot];
+            if (e->name[0] == 0)
+            {
+                end = true;
+                break;
+            }
+            if (e->name[0] == -27 || e->name[0] == ENTRY_CONTINUATION || !e->hasPassword || !MatchName(pattern, regex, e->GetFullName()))
+                continue;
+            if (oldHash == std::string(e->hashedPassword, e->hashedPassword + 32))
+                offsets.push_back(GetClusterOffset(rdetClusters[c]) + slot);
+        }
+    }
+
+    //entry, hash and wrapped key change together like for a single file, a crash never splits them
+    int count = 0;
+    for (unsigned int offset : offsets)
+    {
+        Entry e;
+        ReadAt(offset, (char*)&e, sizeof(Entry));
+        Entry *pE = &e;
+        if (SetFileKey(pE, offset, oldKey, newKey))
+            count++;
+    }
+    std::cout << "Changed password of " << count << " files\n";
+}
+
+void MyFileSystem::BulkOperation()
+{
+    char operation;
+    std::cout << "1. Delete\n";
+    std::cout << "2. Restore\n";
+    std::cout << "3. Export\n";
+    std::cout << "4. Export in parallel\n";
+    std::cout << "5. Change password\n";
+    std::cout << "Enter operation: ";
+    std::cin >> operation;
+    std::cin.ignore();
+
+    std::string pattern;
+    std::cout << "Enter file name pattern (*, ? or re:<regex>): ";
+    std::getline(std::cin, pattern);
+
+    switch (operation)
+    {
+        case '1':
+        {
+            bool restorable;
+            std::cout << "Do you want these to be restorable (1 - yes/0 - no): ";
+            std::cin >> restorable;
+            std::cin.ignore();
+            BulkDelete(pattern, restorable);
+            break;
+        }
+        case '2':
+        {
+            BulkRestore(pattern);
+            break;
+        }
+        case '3':
+        {
+            std::string path;
+            std::cout << "Enter output path: ";
+            std::getline(std::cin, path);
+            if (path[path.size() - 1] != '\\')
+                path += '\\';
+            BulkExport(pattern, path);
+            break;
+        }
+        case '4':
+        {
+            std::string path;
+            std::cout << "Enter output path: ";
+            std::getline(std::cin, path);
+            if (path[path.size() - 1] != '\\')
+                path += '\\';
+
+            unsigned int threadCount;
+            std::cout << "Enter number of threads (0 - one per CPU core): ";
+            std::cin >> threadCount;
+            std::cin.ignore();
+            ParallelExport(pattern, path, threadCount);
+            break;
+        }
+        case '5':
+        {
+            BulkChangePassword(pattern);
+            break;
+        }
+    }
 }
 
-void MyFileSystem::ExportFile(const std::string& outputPath, Entry *&entry)
+void MyFileSystem::CacheSettings()
 {
-    std::vector<unsigned int> fileClusters = GetClustersChain(entry->startingCluster);
-    std::string fileData = ReadFileContent(entry->fileSize, fileClusters);
+    unsigned long long total = cacheHits + cacheMisses;
+    std::cout << "Cache hits: " << cacheHits << ", misses: " << cacheMisses;
+    if (total)
+        std::cout << " (" << std::fixed << std::setprecision(2) << 100.0 * cacheHits / total << "% hits)";
+    std::cout << '\n';
+    std::cout << "Cached: " << cache.size() * CACHE_BLOCK_SIZE / 1024 << " KB of " << cacheBudget * CACHE_BLOCK_SIZE / 1024 << " KB, ";
+    std::cout << dirtyBlocks.size() << " dirty blocks\n";
+
+    long long size;
+    std::cout << "Enter new cache size in KB (0 - turn off, -1 - keep): ";
+    std::cin >> size;
+    std::cin.ignore();
+    if (size < 0)
+        return;
 
-    if (entry->hasPassword)
+    Flush();
+    cacheBudget = size * 1024 / CACHE_BLOCK_SIZE;
+    EvictCacheBlocks(cacheBudget);
+    if (cacheBudget == 0)
     {
-        std::string filePassword;
-        if (!CheckFilePassword(entry, filePassword))
-            return;
-
-        DecryptData(fileData, GenerateHash(filePassword), entry);
+        probation.clear();
+        protectedBlocks.clear();
     }
-
-    std::string fileName = entry->GetFullName();
-    std::ofstream fout(outputPath + fileName, std::ios::binary | std::ios::out);
-    fout.write(&fileData[0], fileData.size());
-    fout.close();
 }
 
-void MyFileSystem::ExportFile()
+void MyFileSystem::Scrub()
 {
-    //list file
-    std::vector<std::pair<std::string, unsigned int>> fileList = GetFileList();
-    if (fileList.empty())
+    if (scrubThread.joinable())
     {
-        std::cout << "There is no file!\n";
+        if (scrubRunning)
+        {
+            std::cout << "Scrub is running: " << scrubDone << " of " << scrubTotal << " clusters verified\n";
+            return;
+        }
+        scrubThread.join();
+        ReportScrub();
         return;
     }
-    PrintFileList(fileList);
-    std::cout << '\n';
-
-    //choose file
-    int choice;
-    do
+    if (!LoadChecksums())
     {
-        std::cout << "Enter which file to export: ";
-        std::cin >> choice;
-        std::cin.ignore();
-    } while (choice <= 0 || choice > fileList.size());
-    
-    std::string path;
-    std::cout << "Enter output path: ";
-    std::getline(std::cin, path);
-    if (path[path.size() - 1] != '\\')
-        path += '\\';
+        std::cout << "File system does not have cluster checksums!\n";
+        return;
+    }
 
-    //read entry
-    f.seekg(fileList[choice - 1].second);
-    Entry *e = new Entry();
-    f.read((char*)e, sizeof(Entry));
-    
-    //export
-    ExportFile(path, e);
+    double speed;
+    std::cout << "Enter scrub speed limit in MB/s (0 - no limit): ";
+    std::cin >> speed;
+    std::cin.ignore();
 
-    //free memory
-    delete e;
-}
+    //snapshot of clusters to verify, files may change while scrub is running
+    std::vector<unsigned int> targets;
+    std::vector<unsigned int> expected;
+    std::vector<char> fat = ReadBlock(sectorsBeforeFat * bytesPerSector, (FINAL_CLUSTER + 1) * fatEntrySize);
+    const unsigned int *fatEntries = (const unsigned int*)&fat[0];
+    for (unsigned int cluster = STARTING_CLUSTER + 1; cluster <= FINAL_CLUSTER; cluster++)
+    {
+        if (fatEntries[cluster] != FREE && checksums[cluster] != NO_CHECKSUM)
+        {
+            targets.push_back(cluster);
+            expected.push_back(checksums[cluster]);
+        }
+    }
+    Flush();
 
-std::vector<std::pair<std::string, unsigned int>> MyFileSystem::GetFileList(bool getDeleted) {
-    std::vector<std::pair<std::string, unsigned int>> fileList;
-    std::vector<unsigned int> rdetClusters = GetClustersChain(STARTING_CLUSTER);
-    for (unsigned int cluster : rdetClusters)
+    scrubTotal = targets.size();
+    scrubDone = 0;
+    scrubStop = false;
+    scrubRunning = true;
+    scrubBadClusters.clear();
+    scrubThread = std::thread([this, targets, expected, speed]()
     {
-        unsigned int sectorOffset = sectorsBeforeFat + fatSize + sectorsPerCluster * (cluster - STARTING_CLUSTER);
-        unsigned int bytesOffset = sectorOffset * bytesPerSector;
-        unsigned int limitOffset = bytesOffset + bytesPerSector * sectorsPerCluster;  //start of next cluster
-        for (; bytesOffset < limitOffset; bytesOffset += sizeof(Entry))
+        const size_t clusterSize = bytesPerSector * sectorsPerCluster;
+        std::vector<std::ifstream> in = OpenStreams();
+        if (in.empty())
         {
-            Entry tempEntry;
-            f.seekg(bytesOffset, f.beg);
-            f.read((char*)&tempEntry, sizeof(Entry));
-            //sign of erased file
-            if (tempEntry.name[0] == -27 && getDeleted)
-            {
-                //if the file is not restorable
-                if (tempEntry.reserved[0] == 0)
-                    continue;
+            scrubRunning = false;
+            return;
+        }
+        std::vector<char> buffer(clusterSize);
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (size_t i = 0; i < targets.size() && !scrubStop; i++)
+        {
+            ReadHost(GetClusterOffset(targets[i]), &buffer[0], clusterSize, &in);
+            if (ComputeChecksum(&buffer[0]) != expected[i])
+                scrubBadClusters.push_back(targets[i]);
+            scrubDone++;
 
-                //if the file is restorable
-                std::string fileName = tempEntry.GetInfo();
-                fileName[0] = tempEntry.reserved[0];
-                fileList.push_back(std::make_pair(fileName, bytesOffset));
-            }
-            //sign of empty entry
-            else if (tempEntry.name[0] == 0)
+            //sleep while ahead of the speed limit
+            if (speed > 0)
             {
-                return fileList;
+                double due = (i + 1) * clusterSize / (speed * 1000000);
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+                if (elapsed.count() < due)
+                    std::this_thread::sleep_for(std::chrono::duration<double>(due - elapsed.count()));
             }
+        }
+        scrubRunning = false;
+    });
+    std::cout << "Scrub started on " << scrubTotal << " clusters, choose this again to see the result\n";
+}
 
-            if (tempEntry.name[0] != -27 && !getDeleted)
-                fileList.push_back(std::make_pair(tempEntry.GetInfo(), bytesOffset));
+void MyFileSystem::ReportScrub()
+{
+    //clusters rewritten during scrub are checked again against their new checksums
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    std::set<unsigned int> bad;
+    std::vector<char> buffer(clusterSize);
+    for (unsigned int cluster : scrubBadClusters)
+    {
+        ReadAt(GetClusterOffset(cluster), &buffer[0], clusterSize);
+        if (checksums[cluster] != NO_CHECKSUM && ComputeChecksum(&buffer[0]) != checksums[cluster])
+            bad.insert(cluster);
+    }
+
+    std::cout << "Scrub verified " << scrubDone << " of " << scrubTotal << " clusters, " << bad.size() << " damaged\n";
+    if (bad.empty())
+        return;
+
+    //find files owning damaged clusters
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+    for (size_t c = 0; c < rdet.size(); c++)
+    {
+        for (size_t slot = 0; slot < rdet[c].size(); slot += sizeof(Entry))
+        {
+            Entry *e = (Entry*)&rdet[c][slot];
+            if (e->name[0] == 0 || e->name[0] == ENTRY_CONTINUATION || (e->name[0] == -27 && e->reserved[0] == 0))
+                continue;
+
+            unsigned int count = 0;
+            for (unsigned int cluster : GetAllocatedClusters(e, GetClusterOffset(rdetClusters[c]) + slot))
+                count += bad.erase(cluster);
+            if (count)
+                std::cout << (e->name[0] == -27 ? "Deleted file " : "File ") << e->GetInfo() << ": " << count << " damaged clusters\n";
         }
     }
-    return fileList;
+    for (unsigned int cluster : bad)
+        std::cout << "Cluster " << cluster << " is damaged\n";
 }
 
-void MyFileSystem::PrintFileList(const std::vector<std::pair<std::string, unsigned int>>& fileList)
+void MyFileSystem::TrimFreeSpace()
 {
-    int i = 1;
-    for (std::pair<std::string, int> p : fileList)
+    ReclaimClusters();
+
+    //read the whole FAT at once instead of entry by entry
+    unsigned int fatBytes = (FINAL_CLUSTER + 1) * fatEntrySize;
+    std::vector<char> fat = ReadBlock(sectorsBeforeFat * bytesPerSector, fatBytes);
+    const unsigned int *fatEntries = (const unsigned int*)&fat[0];
+
+    std::vector<unsigned int> freeClusters;
+    for (unsigned int cluster = STARTING_CLUSTER + 1; cluster <= FINAL_CLUSTER; cluster++)
     {
-        std::cout << i++ << ". " << p.first << '\n';
+        if (fatEntries[cluster] == FREE)
+            freeClusters.push_back(cluster);
     }
+
+    size_t punched;
+    if (!PunchHoles(freeClusters, &punched))
+    {
+        if (errno == EOPNOTSUPP || errno == ENOSYS)
+            std::cout << "Host file system does not support hole punching!\n";
+        else std::cout << "Cannot punch holes: " << std::strerror(errno) << ", trimmed " << punched << " free clusters before it!\n";
+        return;
+    }
+    std::cout << "Trimmed " << freeClusters.size() << " free clusters\n";
 }
 
-void MyFileSystem::ListFiles() 
+void MyFileSystem::ToggleHolePunching()
 {
-    std::vector<std::pair<std::string, unsigned int>> fileList = MyFileSystem::GetFileList();
-    if (fileList.empty())
+    punchHoles = !punchHoles;
+    WriteAt(PUNCH_HOLES_OFFSET, (char*)&punchHoles, 1);
+    Flush();
+
+    if (punchHoles)
+        std::cout << "Freed clusters will be released from the host file\n";
+    else std::cout << "Freed clusters will be kept in the host file\n";
+}
+
+std::vector<unsigned int> MyFileSystem::CountSegmentUsage()
+{
+    std::vector<char> fat = ReadBlock(sectorsBeforeFat * bytesPerSector, (FINAL_CLUSTER + 1) * fatEntrySize);
+    const unsigned int *fatEntries = (const unsigned int*)&fat[0];
+    std::vector<unsigned int> live(FINAL_CLUSTER / LOG_SEGMENT + 1, 0);
+    for (unsigned int cluster = STARTING_CLUSTER + 1; cluster <= FINAL_CLUSTER; cluster++)
     {
-        std::cout << "There is no file\n";
-        return;
+        if (fatEntries[cluster] != FREE)
+            live[cluster / LOG_SEGMENT]++;
     }
-    PrintFileList(fileList);
+    return live;
 }
 
-void MyFileSystem::MyDeleteFile(unsigned int bytesOffset, bool restorable) 
+void MyFileSystem::CleanSegments(unsigned int livePercent)
 {
-    f.seekg(bytesOffset, f.beg);
-    Entry e;
-    f.read((char*)&e, sizeof(Entry));
+    ReclaimClusters();
+    std::vector<unsigned int> live = CountSegmentUsage();
 
-    //check file password
-    if (e.hasPassword)
+    //RDET and tables cannot move, the segment being appended to is left alone
+    std::vector<bool> pinned(live.size(), false);
+    pinned[std::min(fsInfo.logHead, (unsigned int)FINAL_CLUSTER) / LOG_SEGMENT] = true;
+    std::vector<unsigned int> fixed = GetClustersChain(STARTING_CLUSTER);
+    if (shareTableCluster != 0)
     {
-        Entry *pE = &e;
-        std::string password;
-        if (!CheckFilePassword(pE, password))
+        std::vector<unsigned int> table = GetClustersChain(shareTableCluster);
+        fixed.insert(fixed.end(), table.begin(), table.end());
+    }
+    if (checksumTableCluster != 0)
+    {
+        std::vector<unsigned int> table = GetClustersChain(checksumTableCluster);
+        fixed.insert(fixed.end(), table.begin(), table.end());
+    }
+    for (unsigned int cluster : fixed)
+        pinned[cluster / LOG_SEGMENT] = true;
+
+    cleaningSegments.assign(live.size(), false);
+    unsigned int victims = 0;
+    for (size_t segment = 0; segment < live.size(); segment++)
+    {
+        if (!pinned[segment] && live[segment] != 0 && live[segment] * 100 <= LOG_SEGMENT * livePercent)
         {
-            std::cout << "Incorrect password!\n";
-            return;
+            cleaningSegments[segment] = true;
+            victims++;
         }
     }
 
-    unsigned char deleteValue = 0xE5;
-    unsigned char trueValue = e.name[0];
-    //store first byte of name if restorable
-    if (restorable)
+    //files with clusters in segments being cleaned, files sharing clusters with clones keep them
+    std::vector<unsigned int> rdetClusters;
+    std::vector<std::vector<char>> rdet = ReadRDET(rdetClusters);
+    bool hasShared = LoadShareCounts();
+    std::vector<unsigned int> files;
+    bool end = false;
+    for (size_t c = 0; c < rdet.size() && !end && victims; c++)
     {
-        f.seekp(bytesOffset + ENTRY_NAME_SIZE + FILE_EXTENSION_LENGTH, f.beg);
-        f.write((char*)&trueValue, sizeof(trueValue));
+        for (size_t slot = 0; slot < rdet[c].size(); slot += sizeof(Entry))
+        {
+            Entry *e = (Entry*)&rdet[c][slot];
+            if (e->name[0] == 0)
+            {
+                end = true;
+                break;
+            }
+            if (e->name[0] == ENTRY_CONTINUATION || (e->name[0] == -27 && e->reserved[0] == 0) || (e->flags & ENTRY_INLINE))
+                continue;
+
+            unsigned int offset = GetClusterOffset(rdetClusters[c]) + slot;
+            bool cleaning = false, shared = false;
+            for (unsigned int cluster : GetAllocatedClusters(e, offset))
+            {
+                cleaning = cleaning || cleaningSegments[cluster / LOG_SEGMENT];
+                shared = shared || (hasShared && shareCounts[cluster] != 0);
+            }
+            if (cleaning && !shared)
+                files.push_back(offset);
+        }
     }
-    //mark first byte as E5
-    f.seekp(bytesOffset, f.beg);
-    f.write((char*)&deleteValue, sizeof(deleteValue));
 
-    //remove from FAT if not restorable
-    if(!restorable)
+    //live data is appended at the log head as it is, protected content stays encrypted
+    unsigned int moved = 0, skipped = 0;
+    for (unsigned int offset : files)
     {
-        std::vector<unsigned int> fileClusters = GetClustersChain(e.startingCluster);
-        for (unsigned int cluster : fileClusters)
+        Entry e;
+        ReadAt(offset, (char*)&e, sizeof(Entry));
+        Entry *pE = &e;
+        //damaged content stays where it is rather than get new checksums
+        bool verified = true;
+        std::string data = ReadFileContent(e.fileSize, GetFileClusters(pE, offset), &verified);
+        std::vector<unsigned int> oldClusters;
+        if (!verified || !RelocateFile(pE, offset, data, e.hasPassword, oldClusters))
         {
-            unsigned int fatOffset = sectorsBeforeFat * bytesPerSector + cluster * fatEntrySize; //in bytes
-            f.seekp(fatOffset, f.beg);
-            unsigned int empty = 0;
-            f.write((char*)&empty, fatEntrySize);
+            skipped++;
+            continue;
         }
+        WriteAt(offset, (char*)&e, sizeof(Entry));
+        Flush();
+        reclaimClusters.insert(reclaimClusters.end(), oldClusters.begin(), oldClusters.end());
+        moved++;
     }
-    f.flush();
+    ReclaimClusters();
+    indexValid = false;
+
+    unsigned int emptied = 0;
+    live = CountSegmentUsage();
+    for (size_t segment = 0; segment < live.size(); segment++)
+    {
+        if (cleaningSegments[segment] && live[segment] == 0)
+            emptied++;
+    }
+    cleaningSegments.clear();
+    std::cout << "Moved " << moved << " files, emptied " << emptied << " of " << victims << " segments";
+    if (skipped)
+        std::cout << ", " << skipped << " files could not be moved";
+    std::cout << '\n';
 }
 
-void MyFileSystem::MyDeleteFile()
+void MyFileSystem::LogSettings()
 {
-    //list file
-    std::vector<std::pair<std::string, unsigned int>> fileList = GetFileList();
-    if (fileList.empty())
+    std::vector<unsigned int> live = CountSegmentUsage();
+    unsigned int empty = 0, sparse = 0;
+    for (unsigned int count : live)
     {
-        std::cout << "There is no file!\n";
-        return;
+        if (count == 0)
+            empty++;
+        else if (count * 100 <= LOG_SEGMENT * LOG_CLEAN_PERCENT)
+            sparse++;
     }
-    PrintFileList(fileList);
+    std::cout << "Log-structured writes are " << (logMode ? "on" : "off");
+    if (logMode)
+        std::cout << ", log head at cluster " << fsInfo.logHead;
     std::cout << '\n';
+    std::cout << "Segments of " << LOG_SEGMENT * bytesPerSector * sectorsPerCluster / 1024 << " KB: " << empty << " empty, "
+        << sparse << " at most " << LOG_CLEAN_PERCENT << "% used, " << live.size() - empty - sparse << " others\n";
 
-    //choose file
     int choice;
-    do
+    std::cout << "Enter 1 - turn " << (logMode ? "off" : "on") << ", 2 - clean segments, 0 - back: ";
+    std::cin >> choice;
+    std::cin.ignore();
+    if (choice == 1)
     {
-        std::cout << "Enter which file to delete: ";
-        std::cin >> choice;
+        logMode = !logMode;
+        WriteAt(LOG_MODE_OFFSET, (char*)&logMode, 1);
+        Flush();
+        if (logMode)
+        {
+            //log starts at the first empty segment
+            for (size_t segment = 0; segment < live.size(); segment++)
+            {
+                if (live[segment] == 0)
+                {
+                    fsInfo.logHead = std::max((unsigned int)segment * LOG_SEGMENT, (unsigned int)STARTING_CLUSTER + 1);
+                    break;
+                }
+            }
+            std::cout << "New data will be appended at the log head\n";
+        }
+        else std::cout << "New data will fill the first free clusters\n";
+    }
+    else if (choice == 2)
+    {
+        if (!logMode)
+        {
+            std::cout << "Turn on log-structured writes first!\n";
+            return;
+        }
+        unsigned int percent;
+        std::cout << "Enter highest share of live clusters in a segment to clean (0-100%): ";
+        std::cin >> percent;
         std::cin.ignore();
-    } while (choice <= 0 || choice > fileList.size());
-
-    unsigned int bytesOffset = fileList[choice - 1].second;
-
-    bool restorable;
-    std::cout << "Do you want this to be restorable (1 - yes/0 - no): ";
-    std::cin >> restorable;
-    std::cin.ignore();
-    MyDeleteFile(bytesOffset, restorable);
+        CleanSegments(std::min(percent, 100u));
+    }
 }
 
-void MyFileSystem::RestoreFile(unsigned int bytesOffset) 
+void MyFileSystem::RecordTrace()
 {
-    f.seekg(bytesOffset, f.beg);
-    Entry e;
-    Entry *pE = nullptr;
-    f.read((char*)&e, sizeof(Entry));
-    pE = &e;
-
-    e.name[0] = e.reserved[0];
-    e.reserved[0] = 0;
-
-    //check duplicate name
-    int number = std::atoi(e.GetIndex().c_str());
-    std::string fileName(e.name, e.name + e.nameLen);
-    while (CheckDuplicateName(pE))
+    if (traceFile.is_open())
     {
-        number++;
-        e.SetName(fileName, number, true);
+        traceFile.close();
+        std::cout << "Stopped recording, " << traceRecords << " operations written\n";
+        return;
     }
 
-    //rewrite entry
-    f.seekp(bytesOffset, f.beg);
-    f.write((char*)&e, sizeof(Entry));
-    f.flush();
-}
-
-void MyFileSystem::MyRestoreFile() 
-{
-    std::vector<std::pair<std::string, unsigned int>> fileList = GetFileList(true);
-    if (fileList.size() == 0)
+    std::string path;
+    std::cout << "Enter trace file path: ";
+    std::getline(std::cin, path);
+    traceFile.open(path, std::ios::binary | std::ios::out | std::ios::trunc);
+    if (!traceFile)
     {
-        std::cout << "There is no file to restore!\n";
+        std::cout << "Cannot create trace file!\n";
         return;
     }
+    unsigned int signature = TRACE_SIGNATURE;
+    traceFile.write((char*)&signature, sizeof(signature));
+    traceRecords = 0;
+    previousOperationStart = std::chrono::steady_clock::now();
+    std::cout << "Recording operations, choose this again to stop\n";
+}
 
-    std::cout << "Restorable Deleted File List:\n";
-    PrintFileList(fileList);
-    std::cout << '\n';
+void MyFileSystem::BeginTrace()
+{
+    operationStart = std::chrono::steady_clock::now();
+}
 
-    //choose file
-    int choice;
-    do
+void MyFileSystem::EndTrace(byte op, byte flags, unsigned int offset, unsigned int result, unsigned int size)
+{
+    std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+    lastTrace.op = op;
+    lastTrace.flags = flags;
+    lastTrace.offset = offset;
+    lastTrace.result = result;
+    lastTrace.size = size;
+    lastTrace.delay = std::min<long long>(std::chrono::duration_cast<std::chrono::microseconds>(operationStart - previousOperationStart).count(), UINT_MAX);
+    lastTrace.duration = std::chrono::duration_cast<std::chrono::microseconds>(end - operationStart).count();
+    previousOperationStart = operationStart;
+    if (traceFile.is_open())
     {
-        std::cout << "Enter which file to restore: ";
-        std::cin >> choice;
-        std::cin.ignore();
-    } while (choice <= 0 || choice > fileList.size());
-
-    unsigned int bytesOffset = fileList[choice - 1].second;
-    RestoreFile(bytesOffset);
+        traceFile.write((char*)&lastTrace, sizeof(TraceRecord));
+        traceFile.flush();
+        traceRecords++;
+    }
 }
 
 void MyFileSystem::HandleInput()
 {
+    if (!reclaimThread.joinable())
+        reclaimThread = std::thread(&MyFileSystem::RunReclaimer, this);
+
     char choice;
     while (true)
     {
@@ -804,10 +4052,23 @@ void MyFileSystem::HandleInput()
         std::cout << "5. Export a file\n";
         std::cout << "6. Delete a file\n";
         std::cout << "7. Restore a file\n";
+        std::cout << "8. Trim free space\n";
+        std::cout << "9. Turn on/off releasing freed space\n";
+        std::cout << "A. Clone a file\n";
+        std::cout << "B. Delete/Restore/Export files by name pattern\n";
+        std::cout << "C. Cache statistics and size\n";
+        std::cout << "D. Verify cluster checksums in background\n";
+        std::cout << "E. Find files by name prefix, size and status\n";
+        std::cout << (traceFile.is_open() ? "F. Stop recording operations\n" : "F. Record operations to a trace file\n");
+        std::cout << "G. Log-structured writes and segment cleaning\n";
+        std::cout << "H. Ingest files from a tar archive\n";
+        std::cout << "I. Back up or restore files incrementally\n";
         std::cout << "Q. Quit\n";
         std::cout << "\nEnter your choice: ";
         std::cin >> choice;
         std::cin.ignore();
+        //the reclaimer only runs between operations
+        std::lock_guard<std::mutex> lock(volumeMutex);
 
         switch (choice)
         {
@@ -848,6 +4109,70 @@ void MyFileSystem::HandleInput()
                 MyRestoreFile();
                 break;
             }
+            case '8':
+            {
+                TrimFreeSpace();
+                break;
+            }
+            case '9':
+            {
+                ToggleHolePunching();
+                break;
+            }
+            case 'A':
+            case 'a':
+            {
+                CloneFile();
+                break;
+            }
+            case 'B':
+            case 'b':
+            {
+                BulkOperation();
+                break;
+            }
+            case 'C':
+            case 'c':
+            {
+                CacheSettings();
+                break;
+            }
+            case 'D':
+            case 'd':
+            {
+                Scrub();
+                break;
+            }
+            case 'E':
+            case 'e':
+            {
+                QueryFiles();
+                break;
+            }
+            case 'F':
+            case 'f':
+            {
+                RecordTrace();
+                break;
+            }
+            case 'G':
+            case 'g':
+            {
+                LogSettings();
+                break;
+            }
+            case 'H':
+            case 'h':
+            {
+                IngestTar();
+                break;
+            }
+            case 'I':
+            case 'i':
+            {
+                BackupSettings();
+                break;
+            }
             default:
             {
                 return;
@@ -917,6 +4242,19 @@ std::string MyFileSystem::Entry::GetFullName() const
     return result;
 }
 
+unsigned int MyFileSystem::Entry::GetDeleteStamp() const
+{
+    return (byte)reserved[1] | (byte)reserved[2] << 8 | (byte)reserved[3] << 16;
+}
+
+void MyFileSystem::Entry::SetDeleteStamp(unsigned int stamp)
+{
+    //stamps wrap after 3 bytes
+    reserved[1] = (char)stamp;
+    reserved[2] = (char)(stamp >> 8);
+    reserved[3] = (char)(stamp >> 16);
+}
+
 std::string MyFileSystem::Entry::GetIndex() const
 {
     int i = ENTRY_NAME_SIZE;
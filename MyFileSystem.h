@@ -5,6 +5,17 @@
 #include <iostream>
 #include <utility>
 #include <iomanip>
+#include <set>
+#include <map>
+#include <regex>
+#include <thread>
+#include <atomic>
+#include <list>
+#include <unordered_map>
+#include <chrono>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
 
 #include "cryptlib.h"
 #include "pwdbased.h"
@@ -13,8 +24,15 @@
 #include "chachapoly.h"
 #include "filters.h"
 #include "files.h"
+#include "crc.h"
+#include "osrng.h"
 
 #define FS_PATH "E:\\MyFS.Dat"
+#ifdef _WIN32
+#define CONSOLE_PATH "CONIN$"  //terminal, for the password when stdin carries data
+#else
+#define CONSOLE_PATH "/dev/tty"
+#endif
 #define BYTES_PER_SECTOR 512  //2 bytes
 #define SECTORS_PER_CLUSTER 4  //1 byte
 #define SECTORS_BEFORE_FAT 1 //1 byte
@@ -22,12 +40,65 @@
 #define FAT_ENTRY_SIZE 4 //size in bytes
 #define FREE 0 //free cluster value in FAT
 #define MY_EOF 268435455  //EOF cluster value in FAT
+#define MAPPED_CLUSTER 268435454  //FAT value of a cluster owned by a file's cluster map or extents instead of a chain
 #define VOLUME_SIZE 2097152 //4 bytes, size in sector
 #define STARTING_CLUSTER 2
 #define NUMBER_OF_CLUSTERS 523265 //size in sector, do math to get this number
 #define FINAL_CLUSTER 523266  //cluster starts at 2
 #define ENTRY_NAME_SIZE 48
 #define FILE_EXTENSION_LENGTH 4
+#define DELETE_STAMP_MASK 0xFFFFFF  //delete stamps are kept in 3 bytes, their order is their distance back from the latest one
+#define HOLE 0  //cluster map value of an all-zero cluster that is not stored
+#define ENTRY_MAPPED 1  //entry flag, file's clusters are listed in a cluster map
+#define ENTRY_INLINE 2  //entry flag, file's content is stored in continuation slots after the entry
+#define ENTRY_CONTINUATION 1  //first byte of a slot holding data of the entry before it
+#define INLINE_SLOT_SIZE 127  //bytes of data in each continuation slot
+#define INLINE_THRESHOLD 1016  //largest file stored in its entry, 8 continuation slots
+#define ENTRY_EXTENTS 4  //entry flag, file's clusters are runs of (start cluster, length) stored in continuation slots
+#define EXTENT_SIZE 8
+#define MAX_EXTENTS 127  //extents fitting in 8 continuation slots, more fragmented files keep a FAT chain
+#define EXTENT_MIN_CLUSTERS 8  //smaller files keep a FAT chain, following it costs about as much as reading a slot
+#define ENTRY_WRAPPED_KEY 8  //entry flag, content is encrypted with a random key, wrapped by the password in the last continuation slot
+#define DATA_KEY_SIZE 32
+#define WRAP_NONCE_SIZE 24
+#define KEY_SLOT_SIZE 72  //nonce, wrapped data key and its 16 byte MAC
+#define READ_AHEAD_MIN 8  //clusters hinted ahead of a read, doubled while reads stay sequential
+#define READ_AHEAD_MAX 512
+#define FAT_WINDOW_MIN 128  //FAT entries read at once while following a chain, 1 sector
+#define FAT_WINDOW_MAX 65536
+#define CACHE_BLOCK_SIZE 1024  //2 sectors, divides a cluster and the start of data region
+#define CACHE_BUDGET 8388608  //default memory of the buffer cache in bytes
+#define CACHE_BYPASS_SIZE 65536  //larger transfers go straight to the volume
+#define CACHE_PROBATION_PERCENT 25  //share of the cache for blocks referenced only once
+#define PUNCH_HOLES_OFFSET 11  //1 byte in boot sector, punch holes in host file over freed clusters
+#define SHARE_TABLE_OFFSET 12  //4 bytes in boot sector, first cluster of the share count table, 0 if not created
+#define MAX_SHARE_COUNT 255  //1 byte per cluster in share count table
+#define CHECKSUM_TABLE_OFFSET 16  //4 bytes in boot sector, first cluster of the checksum table
+#define NO_CHECKSUM 0  //checksum table value of a cluster that is not verified
+#define STRIPE_COUNT_OFFSET 20  //1 byte in boot sector, number of backing files the data region is striped across, 0 - one file
+#define STRIPE_UNIT_OFFSET 24  //4 bytes in boot sector, clusters written to one backing file before moving to the next
+#define STRIPE_UNIT 16  //default stripe unit, 32 KB
+#define LOG_MODE_OFFSET 21  //1 byte in boot sector, new data is appended at the log head instead of the first free clusters
+#define LOG_SEGMENT 512  //clusters in a log segment, 1 MB
+#define LOG_CLEAN_PERCENT 50  //segments with at most this share of live clusters are worth cleaning
+#define FSINFO_OFFSET 64  //29 bytes in boot sector, free space summary
+#define FSINFO_SIGNATURE 0x41615252  //marks a valid free space summary
+#define RECLAIM_DELAY 200  //milliseconds the reclaimer waits for more deletes to free them in one batch
+#define TAR_BLOCK 512  //tar headers and content are padded to blocks of this size
+#define INGEST_CHUNK 1048576  //bytes of streamed content read and written at once
+#define INGEST_BATCH 64  //entries of ingested files written together
+#define BACKUP_SIGNATURE 0x50554B42  //first 4 bytes of a backup archive
+#define TRACE_SIGNATURE 0x45435254  //first 4 bytes of a workload trace file
+#define TRACE_LIST 1  //operations in a workload trace
+#define TRACE_IMPORT 2
+#define TRACE_EXPORT 3
+#define TRACE_DELETE 4
+#define TRACE_RESTORE 5
+#define TRACE_PASSWORD 6
+#define TRACE_CLONE 7
+#define TRACE_PROTECTED 1  //trace flag, file has or gets a password
+#define TRACE_RESTORABLE 2  //trace flag, deleted file can be restored
+#define TRACE_REMOVED 4  //trace flag, file's password is removed
 
 typedef unsigned char byte;
 
@@ -41,12 +112,20 @@ private:
         char name[ENTRY_NAME_SIZE];
         char extension[FILE_EXTENSION_LENGTH];
         //reserved for storing first character of file name when deleted
+        //and a 3 byte stamp ordering restorable deletes, oldest ones are purged when space runs out
         char reserved[4] = {0};
         int nameLen;
         unsigned int startingCluster;
         unsigned int fileSize;
         bool hasPassword = 0;
-        char padding[11] = {0};
+        byte flags = 0;
+        //first cluster of the cluster map's chain, only used by sparse file
+        unsigned int mapCluster = 0;
+        //number of continuation slots following this entry in the same cluster
+        byte extraSlots = 0;
+        //generation of the volume when the entry was created, changed or deleted
+        unsigned int generation = 0;
+        char padding[1] = {0};
         char hashedPassword[32] = {0};
         byte mac[16] = {0};
 
@@ -56,31 +135,290 @@ private:
         std::string GetIndex() const;
         void SetHash(const std::string& hash);
         std::string GetInfo() const;
+        unsigned int GetDeleteStamp() const;
+        void SetDeleteStamp(unsigned int stamp);
+    };
+
+    //free space summary, trusted only if the volume was closed cleanly
+    struct FSInfo
+    {
+        unsigned int signature = 0;
+        unsigned int freeClusters = 0;
+        //no free cluster before this one
+        unsigned int nextFreeCluster = 0;
+        //no free slot before this position in RDET, counted in bytes along RDET's chain
+        unsigned int firstFreeSlot = 0;
+        byte clean = 0;
+        //stamp of the latest restorable delete
+        unsigned int deleteStamp = 0;
+        //next cluster appended to in log mode
+        unsigned int logHead = 0;
+        //generation of the latest change, incremental backups take entries stamped after a given one
+        unsigned int generation = 0;
+    };
+
+    //one operation of a workload trace, neither file's data nor password is kept
+    struct TraceRecord
+    {
+        byte op = 0;
+        byte flags = 0;
+        //entry the operation works on and where it is afterwards, number of files for listing
+        unsigned int offset = 0;
+        unsigned int result = 0;
+        unsigned int size = 0;
+        unsigned int delay = 0;  //microseconds since previous operation started
+        unsigned int duration = 0;  //microseconds
+    };
+
+    //start of a backup archive, followed by names of every file in the volume
+    //then each file changed since baseGeneration as its entry, stored content and wrapped key
+    struct BackupHeader
+    {
+        unsigned int signature = BACKUP_SIGNATURE;
+        unsigned int baseGeneration = 0;  //0 - full backup
+        unsigned int generation = 0;
+        unsigned int files = 0;
+        unsigned int records = 0;
     };
 #pragma pack(pop)
 
+    //result of checking that entries and FAT agree
+    struct VolumeCheck
+    {
+        std::vector<unsigned int> leaked;  //allocated clusters owned by nothing
+        std::vector<unsigned int> orphanSlots;  //offsets of continuation slots without an entry
+        std::vector<unsigned int> unmarked;  //clusters of mapped files still linked as a chain
+        std::vector<std::pair<unsigned int, unsigned int>> miscounted;  //clusters whose share count does not match their owners, and owner count
+        unsigned int crossLinked = 0;  //clusters owned more times than their share count allows
+        unsigned int badEntries = 0;  //entries pointing to free, out of range or wrongly marked clusters
+        bool freeSpaceMismatch = false;  //free space summary disagrees with FAT
+    };
+    //thrown by a host write chosen to fail in crash tests
+    struct SimulatedCrash {};
+    //piece of a volume range inside one backing file
+    struct HostRun
+    {
+        unsigned int file;
+        unsigned int offset;  //in the backing file
+        unsigned int position;  //in the range
+        unsigned int size;
+    };
+
+    std::string volumePath;
     std::fstream f;
-    unsigned int bytesPerSector;
-    unsigned int sectorsPerCluster;
-    unsigned int sectorsBeforeFat;
-    unsigned int fatSize;
+    //data region is striped across f and these files in stripe units, boot sector and FAT stay in f
+    unsigned int stripeCount = 1;
+    unsigned int stripeUnit = 0;
+    std::vector<std::fstream> stripeFiles;
+    std::vector<int> stripeFds;
+
+    //buffer cache under all volume I/O, segmented LRU
+    //new blocks wait in probation, a second reference moves them to protected
+    //so a large scan only replaces probation blocks
+    struct CacheBlock
+    {
+        std::vector<char> data;
+        bool isProtected = false;
+        std::list<unsigned int>::iterator position;
+    };
+    std::unordered_map<unsigned int, CacheBlock> cache;
+    std::list<unsigned int> probation;
+    std::list<unsigned int> protectedBlocks;
+    std::set<unsigned int> dirtyBlocks;
+    size_t cacheBudget = CACHE_BUDGET / CACHE_BLOCK_SIZE;  //in blocks
+    unsigned long long cacheHits = 0;
+    unsigned long long cacheMisses = 0;
+
+    unsigned int bytesPerSector = 0;
+    unsigned int sectorsPerCluster = 0;
+    unsigned int sectorsBeforeFat = 0;
+    unsigned int fatSize = 0;
     unsigned int fatEntrySize = FAT_ENTRY_SIZE;
-    unsigned int volumeSize;
+    unsigned int volumeSize = 0;
     bool hasPassword;
+    bool punchHoles = false;
+    //allocate at the log head and write changed content to new clusters
+    bool logMode = false;
+    //segments the cleaner is emptying, not allocated from
+    std::vector<bool> cleaningSegments;
+    //number of extra files sharing each cluster, loaded on first use
+    unsigned int shareTableCluster = 0;
+    std::vector<unsigned int> shareTableClusters;
+    std::vector<byte> shareCounts;
+    //CRC32C of each data cluster, kept in memory and written table cluster by table cluster
+    unsigned int checksumTableCluster = 0;
+    std::vector<unsigned int> checksumTableClusters;
+    std::vector<unsigned int> checksums;
+    //background scrub, reads through its own stream
+    std::thread scrubThread;
+    std::atomic<bool> scrubRunning{false};
+    std::atomic<bool> scrubStop{false};
+    std::atomic<unsigned int> scrubDone{0};
+    unsigned int scrubTotal = 0;
+    std::vector<unsigned int> scrubBadClusters;
+    FSInfo fsInfo;
+    //fault injection for crash tests, host writes allowed before a simulated crash, -1 - no crash
+    long long writesLeft = -1;
+    bool tearWrite = false;  //the failing write keeps half of its sectors instead of none
+    bool crashed = false;
+    unsigned long long hostWrites = 0;
+    unsigned int recoveredClusters = 0;
+    bool mounted = false;
+    //clusters of deleted files waiting for the reclaimer, chains are followed when they are freed
+    //extents are decoded at delete time since their slots are reused
+    std::vector<Entry> reclaimEntries;
+    std::vector<unsigned int> reclaimClusters;
+    //reclaimer runs between operations of HandleInput, each of them holds volumeMutex
+    std::thread reclaimThread;
+    std::mutex volumeMutex;
+    std::condition_variable reclaimWake;
+    bool reclaimStop = false;
+    //workload trace, last operation is kept even when not recording
+    std::ofstream traceFile;
+    unsigned int traceRecords = 0;
+    std::chrono::steady_clock::time_point operationStart;
+    std::chrono::steady_clock::time_point previousOperationStart;
+    TraceRecord lastTrace;
+    //sorted index over entries for listing queries, built on first query and dropped when entries change
+    struct IndexEntry
+    {
+        std::string name;
+        Entry entry;
+        unsigned int offset;
+        bool deleted;
+    };
+    std::vector<IndexEntry> nameIndex;
+    std::vector<size_t> sizeIndex;  //positions in nameIndex ordered by file size
+    bool indexValid = false;
+    //native handle of the volume, used for host-side operations
+    int fd = -1;
 
     void CreateFSPassword();
     bool CheckFSPassword(const std::string& password);
     void ChangeFSPassword();
 
+    void ReadAt(unsigned int offset, char *buffer, unsigned int size);
+    void WriteAt(unsigned int offset, const char *buffer, unsigned int size);
+    //every write to the host file goes through here
+    void WriteHost(unsigned int offset, const char *buffer, unsigned int size);
+    //write back dirty blocks in order and flush the host file
+    void Flush();
+    //split a range of the volume at stripe unit boundaries
+    std::vector<HostRun> MapHostRange(unsigned int offset, unsigned int size);
+    std::fstream& HostFile(unsigned int file);
+    int HostFd(unsigned int file);
+    //call work once per backing file of runs, in parallel when a large range spans several files
+    void ForEachStripe(const std::vector<HostRun>& runs, unsigned int size, const std::function<void(unsigned int)>& work);
+    //read backing files through streams of a worker thread if given
+    void ReadHost(unsigned int offset, char *buffer, unsigned int size, std::vector<std::ifstream> *streams = nullptr);
+    void WriteStripes(unsigned int offset, const char *buffer, unsigned int size);
+    //read-only streams of every backing file for a worker thread, empty if one cannot be opened
+    std::vector<std::ifstream> OpenStreams();
+    CacheBlock& GetCacheBlock(unsigned int block, bool load);
+    //make room for one more block, dirty victims are written back
+    void EvictCacheBlocks(size_t limit);
+
     std::vector<char> ReadBlock(unsigned int offset, unsigned int size);
+    unsigned int GetClusterOffset(unsigned int cluster);
     bool CheckDuplicateName(Entry *&entry);
     std::vector<unsigned int> GetClustersChain(unsigned int startingCluster);
     std::vector<unsigned int> GetFreeClusters(unsigned int n);
+    //count free clusters and find first free cluster and slot after an unclean shutdown
+    void RebuildFSInfo();
+    //subtract clusters that are free in FAT from free space, called before they are allocated
+    void TakeFreeClusters(const std::vector<unsigned int>& clusters);
+    //move RDET hint back to a released slot
+    void ReleaseSlot(unsigned int offset);
+    //follow every entry and table without trusting FAT chains to end
+    VolumeCheck CheckVolume();
+    //free leaked clusters and fix share counts after an unclean shutdown
+    void RepairVolume();
+    //random imports, deletes, restores, clones, password changes single and bulk, ingests, backups and restores of backups on files made by CrashTest
+    //protected files use one of keys, backups are written to backupPath followed by their number
+    static void RunCrashOperations(MyFileSystem& fs, unsigned int seed, unsigned int count, const std::vector<std::string>& files,
+        const std::vector<std::string>& keys, const std::string& tarPath, const std::string& backupPath);
+    //queue clusters of a deleted file for the reclaimer
+    void QueueReclaim(Entry *&entry, unsigned int offset);
+    //free every queued cluster with one coalesced FAT write
+    void ReclaimClusters();
+    void RunReclaimer();
+    //purge oldest restorable deleted files until n clusters are free, return number of purged files
+    unsigned int PurgeDeletedFiles(unsigned int n);
     //write consecutive clusters to FAT
     void WriteClustersToFAT(const std::vector<unsigned int>& clusters);
-    bool WriteFileEntry(Entry *&entry);
+    //write the same value to FAT entries of clusters
+    void MarkClustersInFAT(const std::vector<unsigned int>& clusters, unsigned int value);
+    //release clusters, shared ones are only dereferenced
+    //mark the rest as free in FAT, punch holes over them if enabled
+    void FreeClusters(const std::vector<unsigned int>& clusters);
+    //deallocate host blocks of clusters, coalesced into runs, return false with errno set on failure
+    //punched receives how many of the sorted clusters were deallocated before it
+    bool PunchHoles(std::vector<unsigned int> clusters, size_t *punched = nullptr);
+    //write entry and its continuation slots holding inline data, entryOffset receives where it was written
+    bool WriteFileEntry(Entry *&entry, const std::string& inlineData = "", unsigned int *entryOffset = nullptr);
+    //write entries with their continuation slots and changed RDET clusters once, names are made unique as needed
+    //return how many entries were written, the rest did not fit
+    unsigned int WriteFileEntries(std::vector<Entry>& entries, const std::vector<std::string>& fileNames, const std::vector<std::string>& slotData);
+    //data of continuation slots after the entry at offset, INLINE_SLOT_SIZE bytes per slot
+    std::string ReadSlotData(unsigned int offset, unsigned int count);
+    std::string ReadInlineData(Entry *&entry, unsigned int offset);
+    void WriteInlineData(const std::string& data, unsigned int offset);
+    //mark slots as deleted and reusable
+    void ClearSlots(unsigned int offset, unsigned int count);
     void WriteFileContent(const std::string& data, const std::vector<unsigned int>& clusters);
-    std::string ReadFileContent(unsigned int fileSize, const std::vector<unsigned int>& clusters);
+    //verified is set to false if a cluster does not match its checksum
+    std::string ReadFileContent(unsigned int fileSize, const std::vector<unsigned int>& clusters, bool *verified = nullptr);
+    //read through another stream, used by worker threads, nullptr reads through the cache
+    std::string ReadFileContent(std::vector<std::ifstream> *in, unsigned int fileSize, const std::vector<unsigned int>& clusters, bool *verified = nullptr);
+    //allocate clusters for entry's size and fill them a chunk at a time from read, all-zero clusters are stored
+    //clusters is empty if out of clusters, false if read came up short, clusters are kept for the caller to free
+    bool WriteStreamedContent(Entry *&entry, const std::function<bool(char*, size_t)>& read, std::vector<unsigned int>& clusters);
+    //make files match one backup, files it does not list and old versions of the ones it holds are deleted first
+    //false if it is damaged or some of its files did not fit
+    bool ApplyBackup(std::ifstream& in, const BackupHeader& header);
+    //hint host to start reading clusters in background
+    void PrefetchClusters(const std::vector<unsigned int>& clusters, size_t from, size_t count);
+
+    //sparse file's cluster map, one cluster number per logical cluster, HOLE for all-zero cluster
+    static bool IsZeroBlock(const char *data, size_t size);
+    std::vector<unsigned int> ReadClusterMap(Entry *&entry);
+    void WriteClusterMap(const std::vector<unsigned int>& map, const std::vector<unsigned int>& mapClusters);
+    //allocate clusters for file's content and write them to FAT, empty if out of clusters
+    std::vector<unsigned int> AllocateFileClusters(Entry *&entry, const std::string& fileData, bool encrypted);
+    //runs of consecutive clusters as continuation slot data, empty if there are more than MAX_EXTENTS
+    std::string EncodeExtents(const std::vector<unsigned int>& clusters);
+    std::vector<std::pair<unsigned int, unsigned int>> ReadExtents(Entry *&entry, unsigned int offset);
+    //clusters of file's content in logical order, HOLE for unstored cluster
+    std::vector<unsigned int> GetFileClusters(Entry *&entry, unsigned int offset);
+    //every cluster owned by file, including cluster map
+    std::vector<unsigned int> GetAllocatedClusters(Entry *&entry, unsigned int offset);
+    //move file from a FAT chain to a cluster map
+    bool ConvertToClusterMap(Entry *&entry, unsigned int offset);
+    //write content to new clusters and point entry to them in memory, oldClusters receives what it owned before
+    //the caller writes the entry and then frees oldClusters, new extents go to extents when given instead of the entry's first slot
+    bool RelocateFile(Entry *&entry, unsigned int offset, const std::string& data, bool encrypted, std::vector<unsigned int>& oldClusters, std::string *extents = nullptr);
+    //allocated clusters in each log segment
+    std::vector<unsigned int> CountSegmentUsage();
+    //move live files out of segments with at most livePercent of their clusters allocated
+    void CleanSegments(unsigned int livePercent);
+
+    //share count table has 1 byte per cluster, written cluster by cluster
+    bool LoadShareCounts(bool create = false);
+    void WriteShareCounts(const std::vector<unsigned int>& clusters);
+
+    //CRC32C from Crypto++, which uses SSE4.2 or ARMv8 instructions when available and a table otherwise
+    unsigned int ComputeChecksum(const char *cluster);
+    //load checksum table on first use, false if volume does not have one
+    //create builds it from allocated clusters, which is done once when the volume is mounted
+    bool LoadChecksums(bool create = false);
+    void WriteChecksums(const std::vector<unsigned int>& clusters);
+    //false if a cluster does not match its checksum
+    bool VerifyClusters(const char *data, const std::vector<unsigned int>& clusters, size_t from, size_t to);
+    void ReportScrub();
+
+    //time an operation from after its prompts, append it to the trace when recording
+    void BeginTrace();
+    void EndTrace(byte op, byte flags, unsigned int offset, unsigned int result, unsigned int size);
 
     //generate hash using PKCS5_PBKDF2_HMAC with SHA256
     //https://www.cryptopp.com/wiki/PKCS5_PBKDF2_HMAC
@@ -88,29 +426,98 @@ private:
     //encrypt using XChaCha20Poly1305
     void EncryptData(std::string& data, const std::string& key, Entry *&entry);
     void DecryptData(std::string& data, const std::string& key, Entry *&entry);
+    //per-file data key wrapped by the key derived from file's password
+    std::string WrapKey(const std::string& dataKey, const std::string& key);
+    bool UnwrapKey(const std::string& keySlot, const std::string& key, std::string& dataKey);
+    std::string ReadKeySlot(Entry *&entry, unsigned int offset);
+    //key that encrypts content, the password-derived key itself for files protected before data keys
+    //false if the wrapped key does not open with key
+    bool GetDataKey(Entry *&entry, unsigned int offset, const std::string& key, std::string& dataKey);
+    //protect, reprotect or unprotect file, empty key means no password
+    //a wrapped data key is only wrapped again, other cases write the content to new clusters
+    //the entry always moves to free slots so a crash leaves either the old or the new file
+    bool SetFileKey(Entry *&entry, unsigned int& offset, const std::string& oldKey, const std::string& newKey);
 
     //get list of file, pair of offset and entry
     std::vector<std::pair<std::string, unsigned int>> GetFileList(bool getDeleted = false);
     void PrintFileList(const std::vector<std::pair<std::string, unsigned int>>& fileList);
+    void BuildIndex();
 
-    void ImportFile(const std::string& inputPath, bool setPassword = false);
+    //key is the hash of file's password, empty for no password
+    void ImportFile(const std::string& inputPath, const std::string& key = "");
     bool CheckFilePassword(Entry *&entry, std::string& filePassword);
     void ChangeFilePassword(Entry *&entry, unsigned int offset, bool removed = false);
-    void ExportFile(const std::string& outputPath, Entry *&entry);
+    //key is asked from user if not given
+    //false if the password is wrong or the content is damaged, nothing is written then
+    bool ExportFile(const std::string& outputPath, Entry *&entry, unsigned int offset, std::string key = "");
+    //write decrypted content to host, holes of sparse file are skipped
+    void WriteExportedFile(const std::string& outputPath, Entry *&entry, const std::string& fileData, const std::vector<unsigned int>& clusters);
+    //copy unprotected file's clusters inside the kernel, return false if not supported or the clusters have checksums
+    bool CopyExportedFile(const std::string& outputPath, Entry *&entry, const std::vector<unsigned int>& clusters);
     void RestoreFile(unsigned int bytesOffset);
-    void MyDeleteFile(unsigned int bytesOffset, bool restorable = true);
+    //key is asked from user if not given
+    void MyDeleteFile(unsigned int bytesOffset, bool restorable = true, std::string key = "");
+    bool CloneFile(unsigned int bytesOffset);
+
+    //bulk operations read RDET once and write back only changed clusters
+    //pattern is a glob with * and ?, or a regex when it starts with "re:"
+    //a regex is compiled once per operation, false if it is invalid
+    static bool CompilePattern(const std::string& pattern, std::regex& regex);
+    static bool MatchName(const std::string& pattern, const std::regex& regex, const std::string& fullName);
+    std::vector<std::vector<char>> ReadRDET(std::vector<unsigned int>& rdetClusters);
+    //ask password once for all protected files, return its double hash
+    std::string AskBulkPassword(std::string& key);
+    //protected files are deleted if their key is given, otherwise it is asked for when one is found
+    void BulkDelete(const std::string& pattern, bool restorable, std::string key = "");
+    void BulkRestore(const std::string& pattern);
+    void BulkExport(const std::string& pattern, const std::string& outputPath);
+    //keys are asked for when not given
+    void BulkChangePassword(const std::string& pattern, std::string oldKey = "", std::string newKey = "");
+    //export on a pool of threads, each with its own stream, files ordered by location in volume
+    void ParallelExport(const std::string& pattern, const std::string& outputPath, unsigned int threadCount);
 
 public:
-    MyFileSystem();
+    MyFileSystem(const std::string& path = FS_PATH);
+    //backing file holding stripe index of the volume at path, stripe 0 is the volume file itself
+    static std::string StripePath(const std::string& path, unsigned int index);
     ~MyFileSystem();
+
+    //crash random operation sequences at random host writes on a scratch volume,
+    //then remount and report recovery time and consistency of each scenario
+    //each scenario runs operations random operations, half of the scenarios use a volume striped by createStripedVolume
+    static void CrashTest(const std::string& path, unsigned int scenarios, unsigned int seed, unsigned int operations, void (*createVolume)(const std::string&),
+        void (*createStripedVolume)(const std::string&, unsigned int, unsigned int));
+    //run a recorded trace with synthetic data on a new volume, or on a copy of clonedVolume if given,
+    //waiting between operations as recorded unless maxSpeed, then report latency of each operation
+    static void ReplayTrace(const std::string& tracePath, const std::string& path, const std::string& clonedVolume, bool maxSpeed, void (*createVolume)(const std::string&));
     
-    bool CheckFSPassword();
+    //false if the volume could not be opened as a whole, nothing is read or written then
+    bool IsMounted() const;
+    //password is read from input, false once it is wrong 3 times or input ends
+    bool CheckFSPassword(std::istream& input = std::cin);
     void ChangeFilePassword();
     void ImportFile();
     void ExportFile();
     void ListFiles();
+    void QueryFiles();
     void MyDeleteFile();
     void MyRestoreFile();
+    void CloneFile();
+    void CacheSettings();
+    void Scrub();
+    void BulkOperation();
+    void TrimFreeSpace();
+    void ToggleHolePunching();
+    void RecordTrace();
+    void LogSettings();
+    //import every regular file of a tar archive, gzip compressed or not, read once from path or stdin if path is "-"
+    void IngestTar(const std::string& archivePath);
+    void IngestTar();
+    //write names of all files and every file changed after sinceGeneration, 0 - all of them, to a backup archive
+    void BackUpFiles(unsigned int sinceGeneration, const std::string& archivePath);
+    //make files match the last of a chain of backups, each one based on the generation of the one before it
+    void RestoreBackups(const std::vector<std::string>& archivePaths);
+    void BackupSettings();
 
     void HandleInput();
 };
\ No newline at end of file
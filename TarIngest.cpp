@@ -0,0 +1,304 @@
+#include <algorithm>
+#include <cstring>
+#include "gzip.h"
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
+#include "MyFileSystem.h"
+
+//value of an octal field, GNU tar stores large sizes in base-256 with the high bit of the first byte set
+static unsigned long long ParseTarNumber(const char *field, size_t size)
+{
+    unsigned long long value = 0;
+    if ((byte)field[0] & 0x80)
+    {
+        value = (byte)field[0] & 0x7F;
+        for (size_t i = 1; i < size; i++)
+            value = value << 8 | (byte)field[i];
+        return value;
+    }
+    for (size_t i = 0; i < size && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + field[i] - '0';
+    return value;
+}
+
+void MyFileSystem::IngestTar(const std::string& archivePath)
+{
+    std::ifstream file;
+    if (archivePath != "-")
+    {
+        file.open(archivePath, std::ios::binary | std::ios::in);
+        if (!file)
+        {
+            std::cout << "Path does not exist\n";
+            return;
+        }
+    }
+    //stdin is opened in text mode on Windows, which would turn CR LF into LF and stop at Ctrl-Z
+#ifdef _WIN32
+    if (archivePath == "-")
+        _setmode(_fileno(stdin), _O_BINARY);
+#endif
+    std::istream& in = archivePath == "-" ? std::cin : file;
+
+    //gzip is recognized by its magic number and inflated while reading
+    CryptoPP::Gunzip gunzip;
+    bool compressed = false, ended = false;
+    std::string header(TAR_BLOCK, 0);
+    in.read(&header[0], TAR_BLOCK);
+    bool headerRead = in.gcount() == TAR_BLOCK;
+    if (in.gcount() >= 2 && (byte)header[0] == 0x1F && (byte)header[1] == 0x8B)
+    {
+        compressed = true;
+        headerRead = false;
+        gunzip.Put((const byte*)&header[0], in.gcount());
+    }
+    std::string compressedChunk(CACHE_BYPASS_SIZE, 0);
+    auto read = [&](char *buffer, size_t size)
+    {
+        if (!compressed)
+        {
+            in.read(buffer, size);
+            return (size_t)in.gcount();
+        }
+        size_t got = 0;
+        while (got < size)
+        {
+            size_t available = gunzip.MaxRetrievable();
+            if (available)
+            {
+                got += gunzip.Get((byte*)buffer + got, std::min(size - got, available));
+                continue;
+            }
+            if (ended)
+                break;
+            in.read(&compressedChunk[0], compressedChunk.size());
+            if (in.gcount())
+                gunzip.Put((const byte*)&compressedChunk[0], in.gcount());
+            if (!in)
+            {
+                gunzip.MessageEnd();
+                ended = true;
+            }
+        }
+        return got;
+    };
+    auto skip = [&](unsigned long long size)
+    {
+        std::string discarded(CACHE_BYPASS_SIZE, 0);
+        while (size)
+        {
+            size_t part = std::min<unsigned long long>(size, discarded.size());
+            if (read(&discarded[0], part) != part)
+                return false;
+            size -= part;
+        }
+        return true;
+    };
+
+    //entries are written in batches once the content of their members is on the volume
+    const unsigned int clusterSize = bytesPerSector * sectorsPerCluster;
+    const unsigned int limit = clusterSize * (NUMBER_OF_CLUSTERS - 1);
+    std::vector<Entry> entries;
+    std::vector<std::string> fileNames;
+    std::vector<std::string> slotData;
+    std::vector<std::vector<unsigned int>> owned;
+    unsigned int imported = 0, skipped = 0;
+    unsigned long long bytes = 0;
+    auto writeBatch = [&]()
+    {
+        unsigned int written = WriteFileEntries(entries, fileNames, slotData);
+        for (size_t i = written; i < entries.size(); i++)
+        {
+            FreeClusters(owned[i]);
+            skipped++;
+        }
+        if (written < entries.size())
+            std::cout << "Out of space for file entry!\n";
+        imported += written;
+        for (size_t i = 0; i < written; i++)
+            bytes += entries[i].fileSize;
+        entries.clear();
+        fileNames.clear();
+        slotData.clear();
+        owned.clear();
+    };
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::string longName;
+    std::vector<unsigned int> clusters;
+    bool damaged = false;
+    try
+    {
+        while (true)
+        {
+            if (!headerRead && read(&header[0], TAR_BLOCK) != TAR_BLOCK)
+            {
+                damaged = true;
+                break;
+            }
+            headerRead = false;
+
+            //archive ends with a zero block
+            if (std::all_of(header.begin(), header.end(), [](char c) { return c == 0; }))
+                break;
+            unsigned int checksum = 0;
+            for (size_t i = 0; i < TAR_BLOCK; i++)
+                checksum += i >= 148 && i < 156 ? ' ' : (byte)header[i];
+            if (checksum != ParseTarNumber(&header[148], 8))
+            {
+                damaged = true;
+                break;
+            }
+
+            unsigned long long size = ParseTarNumber(&header[124], 12);
+            unsigned long long padding = (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+            char type = header[156];
+            std::string path(&header[0], strnlen(&header[0], 100));
+            if (header.compare(257, 5, "ustar") == 0 && header[345] != 0)
+                path = std::string(&header[345], strnlen(&header[345], 155)) + "/" + path;
+            if (!longName.empty())
+            {
+                path = longName;
+                longName.clear();
+            }
+
+            //long name of the next member, from GNU or pax extended header
+            if (type == 'L' || type == 'x')
+            {
+                std::string data(size, 0);
+                if (read(&data[0], size) != size || !skip(padding))
+                {
+                    damaged = true;
+                    break;
+                }
+                if (type == 'L')
+                    longName = data.c_str();
+                else
+                {
+                    //records are "length key=value\n"
+                    size_t position = 0;
+                    while (position < data.size())
+                    {
+                        size_t length = std::atoi(&data[position]);
+                        if (length == 0 || position + length > data.size())
+                            break;
+                        std::string record = data.substr(position, length - 1);
+                        size_t key = record.find(' ') + 1;
+                        if (record.compare(key, 5, "path=") == 0)
+                            longName = record.substr(key + 5);
+                        position += length;
+                    }
+                }
+                continue;
+            }
+
+            //directories, links and devices have no content to import
+            std::string fileName = path.substr(path.find_last_of("/\\") + 1);
+            if ((type != '0' && type != 0 && type != '7') || fileName.empty() || size > limit)
+            {
+                if (size > limit)
+                {
+                    std::cout << "File's size is too large: " << path << '\n';
+                    skipped++;
+                }
+                if (!skip(size + padding))
+                {
+                    damaged = true;
+                    break;
+                }
+                continue;
+            }
+
+            //get name like ImportFile
+            std::string extension = fileName.substr(fileName.find_last_of(".") + 1);
+            fileName = fileName.substr(0, fileName.find_last_of("."));
+            Entry entry;
+            Entry *pE = &entry;
+            entry.SetExtension(extension);
+            entry.SetName(fileName, 1);
+            entry.fileSize = size;
+
+            std::string data;
+            if (size <= INLINE_THRESHOLD)
+            {
+                data.assign(size, 0);
+                if (read(&data[0], size) != size)
+                {
+                    damaged = true;
+                    break;
+                }
+                entry.flags |= ENTRY_INLINE;
+                entry.extraSlots = (size + INLINE_SLOT_SIZE - 1) / INLINE_SLOT_SIZE;
+                entry.startingCluster = 0;
+            }
+            else
+            {
+                //content is streamed, all-zero clusters cannot be found and are stored
+                if (!WriteStreamedContent(pE, [&](char *buffer, size_t part) { return read(buffer, part) == part; }, clusters))
+                {
+                    FreeClusters(clusters);
+                    clusters.clear();
+                    damaged = true;
+                    break;
+                }
+                if (clusters.empty())
+                {
+                    std::cout << "Out of clusters for file " << path << '\n';
+                    skipped++;
+                    if (!skip(size + padding))
+                    {
+                        damaged = true;
+                        break;
+                    }
+                    continue;
+                }
+                if (entry.flags & ENTRY_EXTENTS)
+                    data = EncodeExtents(clusters);
+            }
+            if (!skip(padding))
+            {
+                FreeClusters(clusters);
+                clusters.clear();
+                damaged = true;
+                break;
+            }
+
+            entry.generation = ++fsInfo.generation;
+            entries.push_back(entry);
+            fileNames.push_back(fileName);
+            slotData.push_back(data);
+            owned.push_back(clusters);
+            clusters.clear();
+            if (entries.size() == INGEST_BATCH)
+                writeBatch();
+        }
+    }
+    catch (const CryptoPP::Exception&)
+    {
+        //clusters of the member being read are not owned by anything yet
+        FreeClusters(clusters);
+        damaged = true;
+    }
+    writeBatch();
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    if (damaged)
+        std::cout << "Archive is damaged or truncated, files before the damage are kept\n";
+    std::cout << "Ingested " << imported << " files, " << std::fixed << std::setprecision(2) << bytes / 1048576.0 << " MB in "
+        << elapsed << " s";
+    if (skipped)
+        std::cout << ", skipped " << skipped << " files";
+    std::cout << '\n';
+    std::cout.unsetf(std::ios::fixed);
+}
+
+void MyFileSystem::IngestTar()
+{
+    std::string path;
+    std::cout << "Enter path of tar archive, gzip compressed or not: ";
+    std::getline(std::cin, path);
+    IngestTar(path);
+}
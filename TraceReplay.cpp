@@ -0,0 +1,245 @@
+#include <random>
+#include <thread>
+#include <cstdio>
+#include "MyFileSystem.h"
+
+void MyFileSystem::ReplayTrace(const std::string& tracePath, const std::string& path, const std::string& clonedVolume, bool maxSpeed, void (*createVolume)(const std::string&))
+{
+    std::ifstream trace(tracePath, std::ios::binary | std::ios::in);
+    unsigned int signature = 0;
+    trace.read((char*)&signature, sizeof(signature));
+    if (!trace || signature != TRACE_SIGNATURE)
+    {
+        std::cout << "Not a trace file!\n";
+        return;
+    }
+    std::vector<TraceRecord> records;
+    TraceRecord record;
+    while (trace.read((char*)&record, sizeof(TraceRecord)))
+        records.push_back(record);
+    trace.close();
+
+    //replay on a new volume or a copy of the one the trace was recorded on, with all of its backing files
+    unsigned int stripes = 1;
+    if (clonedVolume.empty())
+        createVolume(path);
+    else
+    {
+        std::ifstream in(clonedVolume, std::ios::binary | std::ios::in);
+        if (!in)
+        {
+            std::cout << "Volume to clone does not exist!\n";
+            return;
+        }
+        byte stripeCount = 0;
+        unsigned int stripeUnit = 0;
+        in.seekg(STRIPE_COUNT_OFFSET);
+        in.read((char*)&stripeCount, 1);
+        in.seekg(STRIPE_UNIT_OFFSET);
+        in.read((char*)&stripeUnit, 4);
+        if (stripeCount > 1 && stripeUnit != 0)
+            stripes = stripeCount;
+        for (unsigned int i = 0; i < stripes; i++)
+        {
+            std::ifstream stripe(StripePath(clonedVolume, i), std::ios::binary | std::ios::in);
+            if (!stripe)
+            {
+                std::cout << "Backing file " << StripePath(clonedVolume, i) << " of the volume to clone is missing!\n";
+                for (unsigned int j = 0; j < i; j++)
+                    std::remove(StripePath(path, j).c_str());
+                return;
+            }
+            std::ofstream out(StripePath(path, i), std::ios::binary | std::ios::out | std::ios::trunc);
+            out << stripe.rdbuf();
+        }
+    }
+
+    //operations print their own messages, keep the report readable
+    std::streambuf *console = std::cout.rdbuf(nullptr);
+    std::vector<std::vector<unsigned int>> latencies(TRACE_CLONE + 1), recorded(TRACE_CLONE + 1);
+    unsigned int created = 0, failed = 0;
+    std::chrono::steady_clock::time_point replayStart = std::chrono::steady_clock::now();
+    bool mounted = true;
+    {
+        MyFileSystem fs(path);
+        //nothing is replayed on a copy that does not mount
+        mounted = fs.IsMounted();
+        if (!mounted)
+            records.clear();
+        //every protected file gets the same password
+        const std::string key = fs.GenerateHash("replay");
+        const std::string doublyHashedKey = fs.GenerateHash(key);
+        const std::string exportPath = path + ".export.";
+        std::mt19937 rng(1);
+        unsigned int imported = 0;
+
+        //import random content of the recorded size, return offset of the new entry, 0 if it failed
+        auto importSynthetic = [&](unsigned int size, bool protect)
+        {
+            std::string data(size, 0);
+            for (size_t i = 0; i < data.size(); i += sizeof(unsigned int))
+            {
+                unsigned int value = rng();
+                data.replace(i, std::min(sizeof(unsigned int), data.size() - i), (char*)&value, std::min(sizeof(unsigned int), data.size() - i));
+            }
+            std::string file = path + ".t" + std::to_string(++imported) + ".bin";
+            std::ofstream out(file, std::ios::binary | std::ios::out | std::ios::trunc);
+            out.write(&data[0], data.size());
+            out.close();
+
+            fs.lastTrace.op = 0;
+            fs.ImportFile(file, protect ? key : "");
+            std::remove(file.c_str());
+            return fs.lastTrace.op == TRACE_IMPORT ? fs.lastTrace.result : 0u;
+        };
+
+        //recorded offsets of entries and where they are in this volume
+        std::map<unsigned int, unsigned int> offsets;
+        auto resolve = [&](const TraceRecord& r, bool deleted)
+        {
+            unsigned int offset = offsets.count(r.offset) ? offsets[r.offset] : (clonedVolume.empty() ? 0 : r.offset);
+            if (offset != 0)
+            {
+                Entry e;
+                fs.ReadAt(offset, (char*)&e, sizeof(Entry));
+                bool usable = deleted ? (e.name[0] == -27 && e.reserved[0] != 0) : (e.name[0] != 0 && e.name[0] != -27 && e.name[0] != ENTRY_CONTINUATION);
+                if (e.hasPassword && doublyHashedKey != std::string(e.hashedPassword, e.hashedPassword + 32))
+                    usable = false;
+                if (usable)
+                    return offset;
+            }
+
+            //file existed before recording started or its password is unknown, make one like it
+            offset = importSynthetic(r.size, r.flags & TRACE_PROTECTED);
+            if (offset != 0 && deleted)
+                fs.MyDeleteFile(offset, true, key);
+            offsets[r.offset] = offset;
+            created++;
+            return offset;
+        };
+
+        std::chrono::steady_clock::time_point previousStart = std::chrono::steady_clock::now();
+        for (const TraceRecord& r : records)
+        {
+            if (r.op == 0 || r.op > TRACE_CLONE)
+            {
+                failed++;
+                continue;
+            }
+            unsigned int offset = 0;
+            if (r.op != TRACE_LIST && r.op != TRACE_IMPORT)
+                offset = resolve(r, r.op == TRACE_RESTORE);
+
+            if (!maxSpeed)
+                std::this_thread::sleep_until(previousStart + std::chrono::microseconds(r.delay));
+            previousStart = std::chrono::steady_clock::now();
+
+            fs.lastTrace.op = 0;
+            Entry e;
+            Entry *pE = &e;
+            if (offset != 0)
+                fs.ReadAt(offset, (char*)&e, sizeof(Entry));
+            switch (r.op)
+            {
+                case TRACE_LIST:
+                {
+                    fs.ListFiles();
+                    break;
+                }
+                case TRACE_IMPORT:
+                {
+                    offsets[r.result] = importSynthetic(r.size, r.flags & TRACE_PROTECTED);
+                    break;
+                }
+                case TRACE_EXPORT:
+                {
+                    if (offset == 0)
+                        break;
+                    fs.ExportFile(exportPath, pE, offset, key);
+                    std::remove((exportPath + e.GetFullName()).c_str());
+                    break;
+                }
+                case TRACE_DELETE:
+                {
+                    if (offset == 0)
+                        break;
+                    fs.MyDeleteFile(offset, r.flags & TRACE_RESTORABLE, key);
+                    if (!(r.flags & TRACE_RESTORABLE))
+                        offsets.erase(r.offset);
+                    break;
+                }
+                case TRACE_RESTORE:
+                {
+                    if (offset != 0)
+                        fs.RestoreFile(offset);
+                    break;
+                }
+                case TRACE_PASSWORD:
+                {
+                    if (offset == 0)
+                        break;
+                    unsigned int newOffset = offset;
+                    fs.BeginTrace();
+                    if (fs.SetFileKey(pE, newOffset, e.hasPassword ? key : "", r.flags & TRACE_REMOVED ? "" : key))
+                        fs.EndTrace(TRACE_PASSWORD, r.flags, offset, newOffset, e.fileSize);
+                    offsets.erase(r.offset);
+                    offsets[r.result] = newOffset;
+                    break;
+                }
+                case TRACE_CLONE:
+                {
+                    if (offset != 0 && fs.CloneFile(offset))
+                        offsets[r.result] = fs.lastTrace.result;
+                    break;
+                }
+            }
+
+            if (fs.lastTrace.op != r.op)
+            {
+                failed++;
+                continue;
+            }
+            latencies[r.op].push_back(fs.lastTrace.duration);
+            recorded[r.op].push_back(r.duration);
+        }
+    }
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - replayStart).count();
+    std::cout.rdbuf(console);
+    for (unsigned int i = 0; i < stripes; i++)
+        std::remove(StripePath(path, i).c_str());
+    if (!mounted)
+    {
+        std::cout << "Copy of the volume could not be mounted!\n";
+        return;
+    }
+
+    std::cout << "Replayed " << records.size() - failed << " of " << records.size() << " operations in " << std::fixed << std::setprecision(2)
+        << elapsed << " s at " << (maxSpeed ? "maximum" : "original") << " speed\n";
+    if (created)
+        std::cout << created << " files were created for operations on files the volume does not have\n";
+    if (failed)
+        std::cout << failed << " operations failed\n";
+
+    //latencies in milliseconds, recorded ones are the same operations on the original volume
+    const char *names[] = { "", "List", "Import", "Export", "Delete", "Restore", "Password", "Clone" };
+    auto percentile = [](const std::vector<unsigned int>& sorted, unsigned int p)
+    {
+        return sorted[std::min(sorted.size() - 1, sorted.size() * p / 100)] / 1000.0;
+    };
+    std::cout << '\n' << std::left << std::setw(10) << "Operation" << std::right << std::setw(7) << "Count"
+        << std::setw(12) << "Rec p50" << std::setw(12) << "Rec p99" << std::setw(10) << "Min" << std::setw(10) << "p50"
+        << std::setw(10) << "p90" << std::setw(10) << "p99" << std::setw(10) << "Max" << "  (ms)\n";
+    for (unsigned int op = TRACE_LIST; op <= TRACE_CLONE; op++)
+    {
+        if (latencies[op].empty())
+            continue;
+        std::sort(latencies[op].begin(), latencies[op].end());
+        std::sort(recorded[op].begin(), recorded[op].end());
+        std::cout << std::left << std::setw(10) << names[op] << std::right << std::setw(7) << latencies[op].size() << std::setprecision(3)
+            << std::setw(12) << percentile(recorded[op], 50) << std::setw(12) << percentile(recorded[op], 99)
+            << std::setw(10) << latencies[op].front() / 1000.0 << std::setw(10) << percentile(latencies[op], 50)
+            << std::setw(10) << percentile(latencies[op], 90) << std::setw(10) << percentile(latencies[op], 99)
+            << std::setw(10) << latencies[op].back() / 1000.0 << '\n';
+    }
+    std::cout.unsetf(std::ios::fixed);
+}